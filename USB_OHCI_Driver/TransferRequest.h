@@ -29,20 +29,44 @@
     standardRequest_t *devReq;
     unsigned char     *reqData;
     unsigned int      dataLength;
+    unsigned int      actualLength;
     unsigned int      dataDir;
-    List              *tdList;
+
+    /* TDs on the hardware for this request, each also in tdHash */
+    usbTDQueue_t      tdQueue;
+    usbTDHash_t       *tdHash;
+
+    /* Wired, contiguous copy of reqData the controller uses instead */
+    unsigned char     *dmaData;
+    unsigned int      physDmaData;
+    id                bouncePool;
 
     /* Command */
     int              devCmd;
     int              completionCode;
     port_t           timeOutPort;
     ns_time_t        expireTime;
+    int              hardTimeOut;       /* seconds, for phases started later */
+
+    /*
+     *  Multi-phase transactions.  Each phase is its own request,
+     *  started by the driver as soon as the one before completes.
+     *  The caller only waits on the chain head's transferLock.
+     */
+    id               nextPhase;
+    id               chainHead;
+
+    /* Shared ring slot this request carries, nil for ordinary requests */
+    id               ring;
+    int              ringSlot;
 
     /* IPC */
     NXConditionLock  *transferLock;
 }
 
 - init;
+- reset;
+- (void)tdHash:(usbTDHash_t *)hash;
 - (void)addTransfer:(USBTransfer *)newTD;
 - (void)removeTransfer:(USBTransfer *)oldTD;
 - (void)removeTransferAt:(int)tdIndex;
@@ -66,9 +90,17 @@
 - (void)dataLength:(unsigned int)len;
 - (unsigned int)dataLength;
 
+- (void)actualLength:(unsigned int)len;
+- (unsigned int)actualLength;
+
 - (void)dataDir:(unsigned int)dir;
 - (unsigned int)dataDir;
 
+- (void)dmaData:(unsigned char *)data physical:(unsigned int)physData pool:(id)pool;
+- (unsigned char *)dmaData;
+- (unsigned int)physDmaData;
+- (id)bouncePool;
+
 - (void)command:(int)cmd;
 - (int)command;
 
@@ -81,6 +113,19 @@
 - (void)expireIn:(int)delay;
 - (ns_time_t)expireTime;
 
+- (void)hardTimeOut:(int)seconds;
+- (int)hardTimeOut;
+
+- (void)nextPhase:(id)request;
+- (id)nextPhase;
+- (void)chainHead:(id)request;
+- (id)chainHead;
+
+- (void)ring:(id)newRing slot:(int)slot;
+- (id)ring;
+- (int)ringSlot;
+
 - (NXConditionLock *)transferLock;
+- (void)transferState:(int)state;
 
 @end
@@ -11,58 +11,127 @@
 {
     [super init];
     
-    tdList = [[List alloc] init];
+    tdq_init(&tdQueue);
+    tdHash = NULL;
     transferLock = [[NXConditionLock alloc] initWith:TRANSFER_SETUP];
     expireTime = 0;
+    hardTimeOut = 0;
+    actualLength = 0;
+    dmaData = NULL;
+    physDmaData = 0;
+    bouncePool = nil;
+    nextPhase = nil;
+    chainHead = nil;
+    ring = nil;
+    ringSlot = 0;
     
     return self;
 }
 
+/*
+ *  Make a used request look like a new one so it can go back
+ *  in the pool.  The hash and lock are kept, and the lock goes
+ *  back to TRANSFER_SETUP.  Whoever waited on it has let go of
+ *  it by now, and a request that never started or was never
+ *  waited on was never held.
+ */
+- reset
+{
+    while(tdQueue.head != nil) [self removeTransfer:tdQueue.head];
+
+    device = nil;
+    endpoint = nil;
+    devReq = NULL;
+    reqData = NULL;
+    dataLength = 0;
+    actualLength = 0;
+    dataDir = 0;
+    devCmd = 0;
+    completionCode = HC_CC_NO_ERROR;
+    timeOutPort = PORT_NULL;
+    expireTime = 0;
+    hardTimeOut = 0;
+    dmaData = NULL;
+    physDmaData = 0;
+    bouncePool = nil;
+    nextPhase = nil;
+    chainHead = nil;
+    ring = nil;
+    ringSlot = 0;
+
+    [self transferState:TRANSFER_SETUP];
+
+    return self;
+}
+
 - free
 {
-    [tdList free];
+    while(tdQueue.head != nil) [self removeTransfer:tdQueue.head];
     [transferLock free];
     return [super free];
 }
 
+/*  The controller's TD hash, which every TD on this request goes into */
+- (void)tdHash:(usbTDHash_t *)hash
+{
+    tdHash = hash;
+    return;
+}
+
 - (void)addTransfer:(USBTransfer *)newTD
 {
-    [tdList addObject:newTD];
+    tdr_append(&tdQueue, newTD);
+    newTD->request = self;
+    if(tdHash != NULL) td_hash_insert(tdHash, newTD);
     return;
 }
 
 - (void)removeTransfer:(USBTransfer *)oldTD
 {
-    [tdList removeObject:oldTD];
+    if(oldTD->request != self) return;
+
+    tdr_remove(&tdQueue, oldTD);
+    td_hash_remove(oldTD);
+    oldTD->request = nil;
 }
 
 - (void)removeTransferAt:(int)tdIndex
 {
-    [tdList removeObjectAt:tdIndex];
+    USBTransfer *td = [self transferAt:tdIndex];
+
+    if(td != nil) [self removeTransfer:td];
 }
 
 - (USBTransfer *)transferAt:(int)tdIndex
 {
-    return [tdList objectAt:tdIndex];
+    USBTransfer *td;
+
+    for(td = tdQueue.head; (td != nil) && (tdIndex > 0); td = td->rNext)
+	tdIndex--;
+
+    return td;
 }
 
 
 - (int)numTDsQueued
 {
-    return [tdList count];
+    return tdQueue.count;
 }
      
 
 
 - (USBTransfer *)isTDQueued:(unsigned int)tdAddress
 {
-    int itd,ntds = [tdList count];
+    USBTransfer *td;
 
-    for(itd=0; itd<ntds; itd++) {
-	if([[tdList objectAt:itd] physicalAddress] == tdAddress)
-	    return [tdList objectAt:itd];
+    if(tdHash != NULL) {
+	td = td_hash_find(tdHash, tdAddress);
+	return ((td != nil) && (td->request == self)) ? td : nil;
     }
 
+    for(td = tdQueue.head; td != nil; td = td->rNext)
+	if(td->physTD == tdAddress) return td;
+
     return nil;
 }
 
@@ -123,6 +192,17 @@
 }
 
 
+- (void)actualLength:(unsigned int)len
+{
+    actualLength = len;
+}
+
+- (unsigned int)actualLength
+{
+    return actualLength;
+}
+
+
 - (void)dataDir:(unsigned int)dir
 {
     dataDir = dir;
@@ -134,6 +214,33 @@
 }
 
 
+/*
+ *  When set, the controller moves data through this wired,
+ *  physically contiguous buffer instead of through reqData.
+ */
+- (void)dmaData:(unsigned char *)data physical:(unsigned int)physData pool:(id)pool
+{
+    dmaData = data;
+    physDmaData = physData;
+    bouncePool = pool;
+}
+
+- (unsigned char *)dmaData
+{
+    return dmaData;
+}
+
+- (unsigned int)physDmaData
+{
+    return physDmaData;
+}
+
+- (id)bouncePool
+{
+    return bouncePool;
+}
+
+
 - (void)command:(int)cmd
 {
     devCmd = cmd;
@@ -161,6 +268,17 @@
     return transferLock;
 }
 
+/*
+ *  Move transferLock to a new condition, waking anyone waiting for
+ *  it.  Never called with the lock held; waiters take it with
+ *  lockWhen: and give it straight back.
+ */
+- (void)transferState:(int)state
+{
+    [transferLock lock];
+    [transferLock unlockWith:state];
+}
+
 - (void)timeOutPort:(port_t)intPort
 {
     timeOutPort = intPort;
@@ -196,4 +314,59 @@
 }
 
 
+- (void)hardTimeOut:(int)seconds
+{
+    hardTimeOut = seconds;
+}
+
+
+- (int)hardTimeOut
+{
+    return hardTimeOut;
+}
+
+
+- (void)nextPhase:(id)request
+{
+    nextPhase = request;
+}
+
+
+- (id)nextPhase
+{
+    return nextPhase;
+}
+
+
+- (void)chainHead:(id)request
+{
+    chainHead = request;
+}
+
+
+- (id)chainHead
+{
+    return chainHead;
+}
+
+
+- (void)ring:(id)newRing slot:(int)slot
+{
+    ring = newRing;
+    ringSlot = slot;
+}
+
+
+- (id)ring
+{
+    return ring;
+}
+
+
+- (int)ringSlot
+{
+    return ringSlot;
+}
+
+
 @end
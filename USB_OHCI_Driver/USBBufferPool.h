@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+#define KERNEL 1
+#import <kernserv/kalloc.h>
+#import <driverkit/generalFuncs.h>
+#import <driverkit/kernelDriver.h>
+#import <machkit/NXLock.h>
+#import <objc/Object.h>
+#import "ohci.h"
+
+
+/*
+ *  A pool of equal sized data buffers in wired memory.  Buffers
+ *  are carved out of whole pages and never straddle a page, so
+ *  each one is physically contiguous and its physical address is
+ *  worked out once, here, rather than on every transfer.
+ */
+@interface USBBufferPool : Object
+{
+    unsigned int bufferSize;
+    int numBuffers;
+    int buffersPerPage;
+
+    /* Page-aligned pages and the allocations they came from */
+    int numPages;
+    vm_address_t *pageAlloc;
+    vm_address_t *pageBase;
+    unsigned int *physPageBase;
+
+    /* Stack of free buffer indices */
+    int *freeStack;
+    int numFree;
+    NXLock *poolLock;
+
+    /* Statistics */
+    unsigned int gets;
+    unsigned int misses;
+}
+
+- initWithSize:(unsigned int)size count:(int)count;
+- free;
+
+- (unsigned char *)getBuffer:(unsigned int *)physAddr;
+- (void)putBuffer:(unsigned char *)buffer;
+
+- (unsigned int)bufferSize;
+- (int)numFree;
+
+@end
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+#import "USBBufferPool.h"
+
+@implementation USBBufferPool
+
+- initWithSize:(unsigned int)size count:(int)count
+{
+    unsigned int physReg;
+    IOReturn ioerr;
+    int ipage,ibuf;
+
+    [super init];
+
+    if((size == 0) || (size > HC_PAGE_SIZE) || (count <= 0)) {
+	IOLog("usb - bad buffer pool size %d x %d\n",size,count);
+	return [self free];
+    }
+
+    bufferSize = size;
+    numBuffers = count;
+    buffersPerPage = HC_PAGE_SIZE / size;
+    numPages = (count + buffersPerPage - 1) / buffersPerPage;
+
+    pageAlloc = (vm_address_t *)IOMalloc(numPages * sizeof(vm_address_t));
+    pageBase = (vm_address_t *)IOMalloc(numPages * sizeof(vm_address_t));
+    physPageBase = (unsigned int *)IOMalloc(numPages * sizeof(unsigned int));
+    freeStack = (int *)IOMalloc(numBuffers * sizeof(int));
+
+    /* -free walks pageAlloc, so it has to be clear before any failure */
+    if(pageAlloc != NULL)
+	for(ipage=0; ipage<numPages; ipage++) pageAlloc[ipage] = 0;
+
+    if((pageAlloc == NULL) || (pageBase == NULL) ||
+       (physPageBase == NULL) || (freeStack == NULL)) {
+	IOLog("usb - Kernel Out-Of-Memory allocating buffer pool\n");
+	return [self free];
+    }
+
+    /*
+     *  Allocate twice what we need and use the page-aligned
+     *  page inside it, the same trick as the HCCA buffer.
+     */
+    for(ipage=0; ipage<numPages; ipage++) {
+	pageAlloc[ipage] = (vm_address_t)IOMalloc(2*HC_PAGE_SIZE);
+	if(pageAlloc[ipage] == 0) {
+	    IOLog("usb - Kernel Out-Of-Memory allocating buffer pool page\n");
+	    return [self free];
+	}
+
+	pageBase[ipage] = (pageAlloc[ipage] + HC_PAGE_SIZE - 1) & ~(HC_PAGE_SIZE - 1);
+
+	ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), pageBase[ipage], &physReg);
+	if(ioerr != IO_R_SUCCESS) {
+	    IOLog("usb - Kernel can't translate buffer pool page to physical memory location\n");
+	    return [self free];
+	}
+	physPageBase[ipage] = physReg;
+    }
+
+    for(ibuf=0; ibuf<numBuffers; ibuf++) freeStack[ibuf] = ibuf;
+    numFree = numBuffers;
+
+    poolLock = [[NXLock alloc] init];
+    gets = 0;
+    misses = 0;
+
+    return self;
+}
+
+
+- free
+{
+    int ipage;
+
+    if(pageAlloc != NULL) {
+	for(ipage=0; ipage<numPages; ipage++)
+	    if(pageAlloc[ipage] != 0)
+		IOFree((void *)pageAlloc[ipage], 2*HC_PAGE_SIZE);
+	IOFree(pageAlloc, numPages * sizeof(vm_address_t));
+    }
+
+    if(pageBase != NULL) IOFree(pageBase, numPages * sizeof(vm_address_t));
+    if(physPageBase != NULL) IOFree(physPageBase, numPages * sizeof(unsigned int));
+    if(freeStack != NULL) IOFree(freeStack, numBuffers * sizeof(int));
+
+    [poolLock free];
+
+    return [super free];
+}
+
+
+/*
+ *  Returns NULL if every buffer is in use.  Callers
+ *  are expected to cope with that, not wait for one.
+ */
+- (unsigned char *)getBuffer:(unsigned int *)physAddr
+{
+    int ibuf,ipage,offset;
+
+    [poolLock lock];
+
+    gets++;
+    if(numFree == 0) {
+	misses++;
+	[poolLock unlock];
+	return NULL;
+    }
+
+    ibuf = freeStack[--numFree];
+
+    [poolLock unlock];
+
+    ipage = ibuf / buffersPerPage;
+    offset = (ibuf % buffersPerPage) * bufferSize;
+
+    *physAddr = physPageBase[ipage] + offset;
+    return (unsigned char *)(pageBase[ipage] + offset);
+}
+
+
+- (void)putBuffer:(unsigned char *)buffer
+{
+    int ipage;
+    vm_address_t addr = (vm_address_t)buffer;
+
+    for(ipage=0; ipage<numPages; ipage++) {
+	if((addr >= pageBase[ipage]) && (addr < pageBase[ipage] + HC_PAGE_SIZE))
+	    break;
+    }
+
+    if(ipage >= numPages) {
+	IOLog("usb - buffer %08x doesn't belong to this pool\n",(unsigned int)addr);
+	return;
+    }
+
+    [poolLock lock];
+    freeStack[numFree++] = ipage*buffersPerPage + (addr - pageBase[ipage])/bufferSize;
+    [poolLock unlock];
+
+    return;
+}
+
+
+- (unsigned int)bufferSize
+{
+    return bufferSize;
+}
+
+
+- (int)numFree
+{
+    return numFree;
+}
+
+
+@end
@@ -20,6 +20,7 @@
     int usbSubClass;
     id deviceDriver;
     List *endpointList;
+    deviceDescriptor_t deviceDescriptor;
     
 }
 
@@ -58,6 +59,10 @@
 - (void)setUsbSubClass:(int)newSubClass;
 - (int)usbSubClass;
 
+- (void)setDeviceDescriptor:(deviceDescriptor_t *)newDesc;
+- (deviceDescriptor_t *)deviceDescriptor;
+- (int)numEndpoints;
+
 - (id)transferForPhysicalTD:(unsigned int)physAddress;
 - (id)endpointForPhysicalTD:(unsigned int)physAddress;
 
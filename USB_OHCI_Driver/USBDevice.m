@@ -17,6 +17,7 @@
     usbAddress = 0;
     deviceDriver = nil;
     productDescription = NULL;
+    bzero(&deviceDescriptor, sizeof(deviceDescriptor_t));
 
     /* Make a default control endpoint */
     control = [[USBEndpoint alloc] init];
@@ -200,6 +201,25 @@
     return usbSubClass;
 }
 
+- (void)setDeviceDescriptor:(deviceDescriptor_t *)newDesc
+{
+    bcopy(newDesc, &deviceDescriptor, sizeof(deviceDescriptor_t));
+    return;
+}
+
+
+- (deviceDescriptor_t *)deviceDescriptor
+{
+    return &deviceDescriptor;
+}
+
+
+/* Number of endpoints, not counting the default control endpoint */
+- (int)numEndpoints
+{
+    return [endpointList count] - 1;
+}
+
 - (id)transferForPhysicalTD:(unsigned int)physAddress
 {
     int iep, neps;
@@ -21,7 +21,17 @@
     volatile unsigned int physicalAddress;
     USBEndpoint *nextEndpoint;
     USBEndpoint *prevEndpoint;
-    List *tdList;
+    usbTDQueue_t tdQueue;               /* In hardware order, the blank tail TD last */
+
+    /* Bulk scheduling, see usb.h */
+    int bulkPriority;
+    int bulkWeight;
+    int bulkTurn;                       /* Completions since last rotation */
+    BOOL bulkParked;                    /* Off the hardware list, being moved */
+    usbBulkStats_t bulkStats;
+
+    /* Callers spin this many us for completion before sleeping, 0 = never */
+    int pollLimit;
 }
 
 - init;
@@ -30,11 +40,14 @@
 - (id)tailTransfer;
 
 - (int)numTDsQueued;
+- (unsigned int)bytesPending;
 - queueTransfer:(id)newTransfer;
 - (void)updateTailPointer;
 
 - (void)deQueueTransfer:(USBTransfer *)transfer;
 - (void)unLinkTransfer:(USBTransfer *)transfer;
+- (void)resumeAtTD:(unsigned int)physTD;
+- (void)flushTransfers;
 
 - (ed_t *)descriptor;
 - (unsigned int)physicalAddress;
@@ -77,6 +90,20 @@
 - (BOOL)forceToggle;
 - (void)forceToggle:(BOOL)toggleFlag;
 
+- (void)setBulkPriority:(int)priority;
+- (int)bulkPriority;
+- (void)setBulkWeight:(int)weight;
+- (int)bulkWeight;
+- (BOOL)bulkTurnUsed;
+- (void)bulkCompleted:(unsigned int)nbytes latency:(unsigned int)usec;
+- (void)bulkRotated;
+- (BOOL)bulkParked;
+- (void)bulkParked:(BOOL)parked;
+- (void)bulkStats:(usbBulkStats_t *)stats;
+
+- (void)setPollLimit:(int)usec;
+- (int)pollLimit;
+
 
 - printTDList;
 
@@ -16,10 +16,17 @@
     forceToggle = NO;
 
     /* Make a List to hold Transfer Descriptor Objects queued to this ED */
-    tdList = [[List alloc] init];
+    tdq_init(&tdQueue);
     nextEndpoint = nil;
     prevEndpoint = nil;
 
+    bulkPriority = USB_BULK_PRIORITY_NORMAL;
+    bulkWeight = USB_BULK_DEFAULT_WEIGHT;
+    bulkTurn = 0;
+    bulkParked = NO;
+    bzero(&bulkStats, sizeof(bulkStats));
+    pollLimit = 0;
+
     /* The -Physical- memory location must be aligned to 16-byte boundary */
     /* Allocate wired-down kernel memory */
     buflength = 2*sizeof(ed_t);
@@ -45,27 +52,14 @@
 
     offset = physAligned - physReg;
     physicalAddress = physAligned;
-    descriptor = (ed_t *)(bufstart + offset);
-
-    descriptor->dword0.field.funcAddress = 0;
-    descriptor->dword0.field.epAddress = 0;
-    descriptor->dword0.field.direction = 0;
-    descriptor->dword0.field.speed = 0;
-    descriptor->dword0.field.skip = 1;
-    descriptor->dword0.field.format = 0;
-    descriptor->dword0.field.maxPacket = 8;
-    descriptor->dword0.field.undef1 = 0;
-
-    descriptor->dword1.field.undef1 = 0;
-    descriptor->dword1.field.tailPointer = 0;
+    /* offset is in bytes, bufstart is an (unsigned int *) */
+    descriptor = (ed_t *)((char *)bufstart + offset);
 
-    descriptor->dword2.field.halt = 0;
-    descriptor->dword2.field.toggleCarry = 0;
-    descriptor->dword2.field.zero = 0;
-    descriptor->dword2.field.headPointer = 0;
-
-    descriptor->dword3.field.undef1 = 0;
-    descriptor->dword3.field.nextED = 0;
+    /* Skipped until it's linked in and has something queued */
+    descriptor->dword1.word = 0;
+    descriptor->dword2.word = 0;
+    descriptor->dword3.word = 0;
+    descriptor->dword0.word = ed_flags(0, 0, 0, 0, 1, 0, 8);
 
     return self;
 }
@@ -73,9 +67,13 @@
 
 - free
 {
+    USBTransfer *transfer;
+
     IOFree(bufstart,(int)buflength);
-    [tdList freeObjects];
-    [tdList free];
+    while((transfer = tdQueue.head) != nil) {
+	tdq_remove(&tdQueue, transfer);
+	[transfer free];
+    }
 
     return [super free];
 }
@@ -83,13 +81,26 @@
 
 - (id)tailTransfer
 {
-    return [tdList lastObject];
+    return tdQueue.tail;
 }
 
 
 - (int)numTDsQueued
 {
-    return [tdList count];
+    return tdQueue.count;
+}
+
+
+/*  Bytes still to move on the queued TDs, not counting the blank tail */
+- (unsigned int)bytesPending
+{
+    unsigned int nbytes = 0;
+    USBTransfer *transfer;
+
+    for(transfer = tdQueue.head; transfer != tdQueue.tail; transfer = transfer->qNext)
+	nbytes += [transfer bytesRemaining];
+
+    return nbytes;
 }
 
 
@@ -106,23 +117,27 @@
      *  process them all by updating the tailPointer
      */
 
-    if(descriptor->dword1.field.tailPointer==0) {
-	descriptor->dword1.field.tailPointer = (newPhysTD >> 4);
-	descriptor->dword2.field.headPointer = (newPhysTD >> 4);
+    /*  Terminate the new TD before anything points at it,
+     *  then link it in with a single store.
+     */
+    newTD->dword2.word = 0;
+
+    if(descriptor->dword1.word==0) {
+	descriptor->dword1.word = newPhysTD & 0xFFFFFFF0;
+	descriptor->dword2.word = (newPhysTD & 0xFFFFFFF0) | (descriptor->dword2.word & ED_C);
     }
     else {
 	/* Point nextTD of current tailTD to new TD */
-	td_t *tailTD = [(USBTransfer *)[tdList lastObject] descriptor];
+	td_t *tailTD = [tdQueue.tail descriptor];
 
 	/* Just for grins, check that the nextTD of the tailTD is NULL */
-	if(tailTD->dword2.field.nextTD != 0)
+	if(tailTD->dword2.word != 0)
 	    IOLog("USB OHCI Driver:  TD QUEUE ERROR.  Last Queued TD has non-null value in nextTD\n");
 
-	tailTD->dword2.field.nextTD = (newPhysTD >> 4);
+	tailTD->dword2.word = newPhysTD & 0xFFFFFFF0;
     }
 
-    newTD->dword2.field.nextTD = 0;
-    [tdList addObject:newTransfer];
+    tdq_append(&tdQueue, newTransfer);
 
     return self;
 }
@@ -131,8 +146,8 @@
 
 - (void)deQueueTransfer:(USBTransfer *)transfer
 {
-    /* Remove TD from tdList */
-    [tdList removeObject:transfer];
+    /* Remove TD from the queue */
+    tdq_remove(&tdQueue, transfer);
 
     /* Free memory and kill the TD */
     [transfer free];
@@ -201,12 +216,54 @@
       descriptor->dword2.field.headPointer = nextPhysTD >> 4;
 
     /* Free the desired transfer object */
-    [tdList removeObject:transfer];
+    tdq_remove(&tdQueue, transfer);
     [transfer free];
 
     return;
 }
 	
+
+/*
+ *  Point the ED head at physTD, dropping everything queued ahead
+ *  of it, and clear the halt bit.  The toggle carry is preserved.
+ *  This is a single store, so the ED should be halted or skipped
+ *  while the caller frees the TDs it has jumped over.
+ */
+- (void)resumeAtTD:(unsigned int)physTD
+{
+    descriptor->dword2.word = (physTD & 0xFFFFFFF0) | (descriptor->dword2.word & ED_C);
+    return;
+}
+
+
+
+/*
+ *  Free every TD but the blank tail and restart the ED on it, with
+ *  the halt bit clear and the toggle carry kept.  Only for when the
+ *  controller is stopped; the TDs are freed whether it has finished
+ *  with them or not.
+ */
+- (void)flushTransfers
+{
+    USBTransfer *tail = tdQueue.tail;
+    USBTransfer *transfer;
+    unsigned int physTail;
+
+    if(tail == nil) return;
+
+    while((transfer = tdQueue.head) != tail) {
+	tdq_remove(&tdQueue, transfer);
+	[transfer free];
+    }
+
+    physTail = [tail physicalAddress] & 0xFFFFFFF0;
+    [tail descriptor]->dword2.word = 0;
+    descriptor->dword1.word = physTail;
+    [self resumeAtTD:physTail];
+
+    return;
+}
+
 	
 /* Updating the tail pointer separately allows us to queue several
    TDs individually without processing them until all have been
@@ -217,7 +274,7 @@
 {
     unsigned int physAddr;
 
-    physAddr = [[tdList lastObject] physicalAddress];
+    physAddr = tdQueue.tail->physTD;
     descriptor->dword1.field.tailPointer = (physAddr >> 4);
 
     return;
@@ -375,16 +432,10 @@
 
 - (id)transferForPhysicalTD:(unsigned int)physAddress
 {
-    int itd,ntds;
+    USBTransfer *transfer;
 
-    ntds = [tdList count];
-
-    for(itd=0; itd<ntds; itd++) {
-	USBTransfer *currentTransfer = [tdList objectAt:itd];
-	if([currentTransfer physicalAddress] == physAddress) {
-	    return currentTransfer;
-	}
-    }
+    for(transfer = tdQueue.head; transfer != nil; transfer = transfer->qNext)
+	if(transfer->physTD == physAddress) return transfer;
 
     return nil;
 }
@@ -399,20 +450,113 @@
 {
      forceToggle = toggleFlag;
 }
+
+
+/*
+ *  Bulk scheduling.  The host controller decides where the
+ *  endpoint sits in the bulk list, these just keep the numbers.
+ */
+- (void)setBulkPriority:(int)priority
+{
+    bulkPriority = priority;
+}
+
+
+- (int)bulkPriority
+{
+    return bulkPriority;
+}
+
+
+- (void)setBulkWeight:(int)weight
+{
+    if(weight < 1) weight = 1;
+    bulkWeight = weight;
+}
+
+
+- (int)bulkWeight
+{
+    return bulkWeight;
+}
+
+
+/* Count one completed request.  YES when the endpoint has had its turn */
+- (BOOL)bulkTurnUsed
+{
+    if(++bulkTurn < bulkWeight) return NO;
+
+    bulkTurn = 0;
+    return YES;
+}
+
+
+- (void)bulkCompleted:(unsigned int)nbytes latency:(unsigned int)usec
+{
+    bulkStats.completions++;
+    bulkStats.bytes += nbytes;
+    bulkStats.totalLatency += usec;
+    if(usec > bulkStats.maxLatency) bulkStats.maxLatency = usec;
+}
+
+
+- (void)bulkRotated
+{
+    bulkStats.rotations++;
+}
+
+
+- (BOOL)bulkParked
+{
+    return bulkParked;
+}
+
+
+- (void)bulkParked:(BOOL)parked
+{
+    bulkParked = parked;
+}
+
+
+- (void)bulkStats:(usbBulkStats_t *)stats
+{
+    *stats = bulkStats;
+    stats->priority = bulkPriority;
+    stats->weight = bulkWeight;
+}
+
+
+/*
+ *  Busy-poll completion.  Requests on this endpoint also have their
+ *  done queue write-back moved up to the end of the frame they
+ *  finish in, see -ioRequest:.
+ */
+- (void)setPollLimit:(int)usec
+{
+    if(usec < 0) usec = 0;
+    if(usec > USB_MAX_POLL_LIMIT) usec = USB_MAX_POLL_LIMIT;
+    pollLimit = usec;
+}
+
+
+- (int)pollLimit
+{
+    return pollLimit;
+}
     
 
 
 
 - printTDList
 {
-    int iTD;
+    USBTransfer *transfer;
 
     IOLog("                     ED HeadP:    %08x\n\n",descriptor->dword2.word);
     IODelay(3000);
 
-    for(iTD=0; iTD<[tdList count]; iTD++) {
-	td_t *currentTD = [(USBTransfer *)[tdList objectAt:iTD] descriptor];
-	unsigned int physTD = [(USBTransfer *)[tdList objectAt:iTD] physicalAddress];
+    for(transfer = tdQueue.head; transfer != nil; transfer = transfer->qNext) {
+	td_t *currentTD = [transfer descriptor];
+	unsigned int physTD = transfer->physTD;
 
 	IOLog("                   kernel:    %08x\n",(unsigned int)currentTD);
 	IODelay(3000);
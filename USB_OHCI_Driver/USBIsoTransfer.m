@@ -44,7 +44,8 @@
     offset = physAligned - physReg;
     physicalAddress = physAligned;
 
-    descriptor = (iso_td_t *)(bufstart + offset);
+    /* offset is in bytes, bufstart is an (unsigned int *) */
+    descriptor = (iso_td_t *)((char *)bufstart + offset);
 
     descriptor->dword0.word = 0;
     descriptor->dword1.word = 0;
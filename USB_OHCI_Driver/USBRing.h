@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+#define KERNEL 1
+#import <kernserv/kalloc.h>
+#import <driverkit/generalFuncs.h>
+#import <driverkit/kernelDriver.h>
+#import <machkit/NXLock.h>
+#import <objc/Object.h>
+#import "ohci.h"
+#import "usb.h"
+
+
+/* Valid ringLock values */
+#define RING_IDLE       1200
+#define RING_COMPLETED  1300
+
+
+/*
+ *  A submission/completion ring shared between the driver and a
+ *  producer, bound to one bulk or interrupt endpoint.  The layout
+ *  and the rules for posting and reaping slots are in usb.h.
+ *
+ *  A class driver can post and reap slots in the kernel with
+ *  -nextSlot, -post:length:cookie: and -reap:actual:status:,
+ *  writing straight into -slotData:.  To hand the ring to a user
+ *  process, its d_mmap entry point returns -physicalPage: for
+ *  each page in turn, and the process rings the doorbell through
+ *  USB_RING_DOORBELL_PARAM.
+ *
+ *  One TransferRequest per slot is set up when the ring is opened,
+ *  so the I/O thread turns a posted slot straight into TDs.
+ */
+@interface USBRing : Object
+{
+    usbRingHeader_t *header;
+    unsigned int ringID;
+    int numSlots;
+
+    /* Page-aligned pages and the allocations they came from */
+    int numPages;
+    vm_address_t *pageAlloc;
+    vm_address_t *pageBase;
+    unsigned int *physPageBase;
+
+    /* Where the slots go */
+    id device;
+    id endpoint;
+    id owner;
+    id requests[USB_RING_MAX_SLOTS];
+
+    /*  The driver's own copy of the taken index and of which slots
+     *  are on the hardware.  A mapped header can be written by the
+     *  producer at any time, so it's only ever copied from and
+     *  checked against these.
+     */
+    unsigned int taken;
+    BOOL busy[USB_RING_MAX_SLOTS];
+
+    /* Slots on the hardware, and whether new ones are refused */
+    int numBusy;
+    BOOL closing;
+    NXConditionLock *ringLock;
+}
+
+- initWithSlots:(int)nslots direction:(int)dataDir ringID:(unsigned int)newID;
+- free;
+
+- (usbRingHeader_t *)header;
+- (unsigned int)ringID;
+- (int)numSlots;
+- (unsigned int)slotSize;
+- (unsigned char *)slotData:(int)slot;
+- (unsigned int)physSlotData:(int)slot;
+
+- (int)numPages;
+- (unsigned int)physicalPage:(int)page;
+
+- (void)device:(id)newDevice endpoint:(id)newEndpoint owner:(id)newOwner;
+- (id)device;
+- (id)endpoint;
+- (id)owner;
+
+- (void)request:(id)transRequest forSlot:(int)slot;
+- (id)requestForSlot:(int)slot;
+
+- (int)takeSlot:(unsigned int *)length;
+- (void)slotCompleted:(int)slot actual:(unsigned int)actual status:(int)status;
+- (void)close;
+- (int)numBusy;
+
+- (int)nextSlot;
+- (void)post:(int)slot length:(unsigned int)length cookie:(unsigned int)cookie;
+- (int)reap:(unsigned int *)cookie actual:(unsigned int *)actual status:(int *)status;
+- (void)waitForCompletion;
+
+@end
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+#import "USBRing.h"
+
+@implementation USBRing
+
+- initWithSlots:(int)nslots direction:(int)dataDir ringID:(unsigned int)newID
+{
+    unsigned int physReg;
+    IOReturn ioerr;
+    int ipage,islot;
+
+    [super init];
+
+    if((nslots <= 0) || (nslots > USB_RING_MAX_SLOTS)) {
+	IOLog("usb - bad ring size %d\n",nslots);
+	return nil;
+    }
+
+    ringID = newID;
+    numSlots = nslots;
+    numPages = nslots + 1;
+
+    pageAlloc = (vm_address_t *)IOMalloc(numPages * sizeof(vm_address_t));
+    if(pageAlloc != NULL)
+	for(ipage=0; ipage<numPages; ipage++) pageAlloc[ipage] = 0;
+    pageBase = (vm_address_t *)IOMalloc(numPages * sizeof(vm_address_t));
+    physPageBase = (unsigned int *)IOMalloc(numPages * sizeof(unsigned int));
+
+    if((pageAlloc == NULL) || (pageBase == NULL) || (physPageBase == NULL)) {
+	IOLog("usb - Kernel Out-Of-Memory allocating ring\n");
+	return [self free];
+    }
+
+    /* Same page-aligned page trick as USBBufferPool */
+    for(ipage=0; ipage<numPages; ipage++) {
+	pageAlloc[ipage] = (vm_address_t)IOMalloc(2*HC_PAGE_SIZE);
+	if(pageAlloc[ipage] == 0) {
+	    IOLog("usb - Kernel Out-Of-Memory allocating ring page\n");
+	    return [self free];
+	}
+
+	pageBase[ipage] = (pageAlloc[ipage] + HC_PAGE_SIZE - 1) & ~(HC_PAGE_SIZE - 1);
+
+	ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), pageBase[ipage], &physReg);
+	if(ioerr != IO_R_SUCCESS) {
+	    IOLog("usb - Kernel can't translate ring page to physical memory location\n");
+	    return [self free];
+	}
+	physPageBase[ipage] = physReg;
+    }
+
+    header = (usbRingHeader_t *)pageBase[0];
+    bzero(header, HC_PAGE_SIZE);
+    header->magic = USB_RING_MAGIC;
+    header->version = USB_RING_VERSION;
+    header->ringID = ringID;
+    header->numSlots = numSlots;
+    header->slotSize = HC_PAGE_SIZE;
+    header->direction = dataDir;
+
+    for(islot=0; islot<USB_RING_MAX_SLOTS; islot++) {
+	requests[islot] = nil;
+	busy[islot] = NO;
+    }
+
+    taken = 0;
+    numBusy = 0;
+    closing = NO;
+    ringLock = [[NXConditionLock alloc] initWith:RING_IDLE];
+
+    return self;
+}
+
+
+- free
+{
+    int ipage;
+
+    if(pageAlloc != NULL) {
+	for(ipage=0; ipage<numPages; ipage++)
+	    if(pageAlloc[ipage] != 0)
+		IOFree((void *)pageAlloc[ipage], 2*HC_PAGE_SIZE);
+	IOFree(pageAlloc, numPages * sizeof(vm_address_t));
+    }
+
+    if(pageBase != NULL) IOFree(pageBase, numPages * sizeof(vm_address_t));
+    if(physPageBase != NULL) IOFree(physPageBase, numPages * sizeof(unsigned int));
+
+    if(ringLock != nil) [ringLock free];
+
+    return [super free];
+}
+
+
+- (usbRingHeader_t *)header
+{
+    return header;
+}
+
+
+- (unsigned int)ringID
+{
+    return ringID;
+}
+
+
+- (int)numSlots
+{
+    return numSlots;
+}
+
+
+/*  Not header->slotSize, which the producer can change */
+- (unsigned int)slotSize
+{
+    return HC_PAGE_SIZE;
+}
+
+
+- (unsigned char *)slotData:(int)slot
+{
+    return (unsigned char *)pageBase[slot+1];
+}
+
+
+- (unsigned int)physSlotData:(int)slot
+{
+    return physPageBase[slot+1];
+}
+
+
+- (int)numPages
+{
+    return numPages;
+}
+
+
+/*  Physical address of page n, for mapping the ring into a task */
+- (unsigned int)physicalPage:(int)page
+{
+    if((page < 0) || (page >= numPages)) return 0;
+    return physPageBase[page];
+}
+
+
+- (void)device:(id)newDevice endpoint:(id)newEndpoint owner:(id)newOwner
+{
+    device = newDevice;
+    endpoint = newEndpoint;
+    owner = newOwner;
+}
+
+
+- (id)device
+{
+    return device;
+}
+
+
+- (id)endpoint
+{
+    return endpoint;
+}
+
+
+- (id)owner
+{
+    return owner;
+}
+
+
+- (void)request:(id)transRequest forSlot:(int)slot
+{
+    requests[slot] = transRequest;
+}
+
+
+- (id)requestForSlot:(int)slot
+{
+    return requests[slot];
+}
+
+
+/*
+ *  The driver is about to queue the next posted slot.  Returns its
+ *  number and the length to move, clamped to a page, or -1 if
+ *  there's none or the ring is closing, so -numBusy can only fall
+ *  after -close.  Nothing read from the header is trusted: posted
+ *  is copied once, and a slot the producer says is posted but the
+ *  driver still has on the hardware stops the ring there.
+ */
+- (int)takeSlot:(unsigned int *)length
+{
+    unsigned int posted;
+    int slot;
+
+    [ringLock lock];
+
+    posted = header->posted;
+    if((closing == YES) || (posted == taken) || (posted - taken > numSlots)) {
+	[ringLock unlockWith:[ringLock condition]];
+	return -1;
+    }
+
+    slot = taken % numSlots;
+    if((busy[slot] == YES) || (header->slot[slot].state != USB_SLOT_POSTED)) {
+	[ringLock unlockWith:[ringLock condition]];
+	return -1;
+    }
+
+    *length = header->slot[slot].length;
+    if(*length > HC_PAGE_SIZE) *length = HC_PAGE_SIZE;
+
+    taken++;
+    busy[slot] = YES;
+    numBusy++;
+    header->taken = taken;
+    header->slot[slot].state = USB_SLOT_BUSY;
+
+    [ringLock unlockWith:[ringLock condition]];
+
+    return slot;
+}
+
+
+- (void)slotCompleted:(int)slot actual:(unsigned int)actual status:(int)status
+{
+    [ringLock lock];
+    header->slot[slot].actual = actual;
+    header->slot[slot].status = status;
+    header->slot[slot].state = USB_SLOT_DONE;
+    busy[slot] = NO;
+    numBusy--;
+    [ringLock unlockWith:RING_COMPLETED];
+
+    return;
+}
+
+
+- (void)close
+{
+    [ringLock lock];
+    closing = YES;
+    [ringLock unlockWith:[ringLock condition]];
+}
+
+
+- (int)numBusy
+{
+    return numBusy;
+}
+
+
+/*
+ *  Kernel producer.  Returns the slot to fill next, or -1 if the
+ *  ring is full.  Fill its -slotData:, then -post:length:cookie:.
+ */
+- (int)nextSlot
+{
+    if(header->posted - header->reaped >= numSlots) return -1;
+    return header->posted % numSlots;
+}
+
+
+- (void)post:(int)slot length:(unsigned int)length cookie:(unsigned int)cookie
+{
+    if(length > HC_PAGE_SIZE) length = HC_PAGE_SIZE;
+    header->slot[slot].length = length;
+    header->slot[slot].cookie = cookie;
+    header->slot[slot].state = USB_SLOT_POSTED;
+    header->posted++;
+
+    return;
+}
+
+
+/*
+ *  Kernel consumer.  Hands back the oldest slot if it's done and
+ *  returns its number, or -1.  Its data stays put until the slot
+ *  is posted again.
+ */
+- (int)reap:(unsigned int *)cookie actual:(unsigned int *)actual status:(int *)status
+{
+    int slot = header->reaped % numSlots;
+
+    if(header->posted == header->reaped) return -1;
+    if(header->slot[slot].state != USB_SLOT_DONE) return -1;
+
+    if(cookie != NULL) *cookie = header->slot[slot].cookie;
+    if(actual != NULL) *actual = header->slot[slot].actual;
+    if(status != NULL) *status = header->slot[slot].status;
+
+    header->slot[slot].state = USB_SLOT_FREE;
+    header->reaped++;
+
+    return slot;
+}
+
+
+/*  Sleep until a slot completes */
+- (void)waitForCompletion
+{
+    [ringLock lockWhen:RING_COMPLETED];
+    [ringLock unlockWith:RING_IDLE];
+}
+
+
+@end
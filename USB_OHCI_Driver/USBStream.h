@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+#define KERNEL 1
+#import <kernserv/kalloc.h>
+#import <driverkit/generalFuncs.h>
+#import <driverkit/kernelDriver.h>
+#import <machkit/NXLock.h>
+#import <objc/Object.h>
+#import "usb.h"
+#import "USBRing.h"
+
+
+/*
+ *  A buffered write stream on a bulk OUT endpoint.  Small writes
+ *  are copied into the slot being filled of a private USBRing, and
+ *  the slot goes to the hardware as one multi-packet transfer when
+ *  it reaches the threshold, when the deadline passes, or on
+ *  -flush.  The other slots can be on the bus while one fills.
+ *
+ *  Errors are sticky.  -write:length: doesn't report them, the next
+ *  -flush returns EIO, and -completionCode is the first completion
+ *  code other than NO_ERROR that came back before it.
+ *
+ *  Open and close a stream with -openStreamOnAddress:... and
+ *  -closeStream:from: on the controller.  Closing flushes first.
+ */
+@interface USBStream : Object
+{
+    id controller;
+    USBRing *ring;
+    id owner;
+
+    /* Send a slot at this many bytes, or this many frames after its first write */
+    unsigned int threshold;
+    int deadline;
+
+    /* The slot being filled, -1 if none, and the frame it's due by */
+    int slot;
+    unsigned int fill;
+    usbFrame_t dueFrame;
+    BOOL calloutPending;
+
+    /* First failure since the last flush, and the one it reported */
+    int pendingCode;
+    int completionCode;
+
+    BOOL closing;
+
+    /*  writeLock keeps one writer at a time and is held across sleeps.
+     *  streamLock guards the fill slot against the deadline callout,
+     *  which runs in the I/O thread, and is never held while waiting.
+     */
+    NXLock *writeLock;
+    NXLock *streamLock;
+}
+
+- initWithRing:(USBRing *)newRing
+    controller:(id)newController
+     threshold:(int)nbytes
+      deadline:(int)msecs;
+- free;
+
+- (USBRing *)ring;
+- (id)owner;
+
+- (int)write:(unsigned char *)data length:(int)len;
+- (int)flush;
+- (int)completionCode;
+- (void)close;
+
+- (void)deadlineExpired:(usbFrame_t)frame;
+
+@end
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+#import "USBStream.h"
+#import "UsbOHCI.h"
+
+static void streamDeadline(void *, usbFrame_t);
+
+@implementation USBStream
+
+- initWithRing:(USBRing *)newRing
+    controller:(id)newController
+     threshold:(int)nbytes
+      deadline:(int)msecs
+{
+    [super init];
+
+    ring = newRing;
+    controller = newController;
+    owner = [ring owner];
+
+    if((nbytes <= 0) || (nbytes > [ring slotSize]))
+	nbytes = [ring slotSize];
+    threshold = nbytes;
+    deadline = (msecs > 0) ? msecs : 0;
+
+    slot = -1;
+    fill = 0;
+    dueFrame = 0;
+    calloutPending = NO;
+
+    pendingCode = HC_CC_NO_ERROR;
+    completionCode = HC_CC_NO_ERROR;
+    closing = NO;
+
+    writeLock = [[NXLock alloc] init];
+    streamLock = [[NXLock alloc] init];
+
+    return self;
+}
+
+
+- free
+{
+    if(writeLock != nil) [writeLock free];
+    if(streamLock != nil) [streamLock free];
+
+    return [super free];
+}
+
+
+- (USBRing *)ring
+{
+    return ring;
+}
+
+
+- (id)owner
+{
+    return owner;
+}
+
+
+/*  Hand back finished slots, keeping the first failure.  streamLock held. */
+- (void)reapSlots
+{
+    int status;
+
+    while([ring reap:NULL actual:NULL status:&status] >= 0) {
+	if((status != HC_CC_NO_ERROR) && (pendingCode == HC_CC_NO_ERROR))
+	    pendingCode = status;
+    }
+
+    return;
+}
+
+
+/*
+ *  Post the slot being filled.  From the I/O thread it goes
+ *  straight to the hardware, from anywhere else through the
+ *  doorbell.  streamLock held.
+ */
+- (void)sendSlot:(BOOL)inIOThread
+{
+    if(slot < 0) return;
+
+    [ring post:slot length:fill cookie:0];
+    slot = -1;
+    fill = 0;
+
+    if(inIOThread)
+	[controller serviceRing:ring];
+    else
+	[controller ringDoorbell:ring];
+
+    return;
+}
+
+
+/*
+ *  Get a slot to fill, sleeping until one comes back if they're
+ *  all on the bus.  writeLock held.  Returns with streamLock held.
+ */
+- (void)lockSlot
+{
+    for(;;) {
+	[streamLock lock];
+	if(slot >= 0) return;
+
+	[self reapSlots];
+	slot = [ring nextSlot];
+	if(slot >= 0) break;
+
+	[streamLock unlock];
+	[ring waitForCompletion];
+    }
+
+    fill = 0;
+
+    /* The deadline runs from the first byte in the slot */
+    if(deadline > 0) {
+	dueFrame = [controller currentFrame] + deadline;
+	if((calloutPending == NO) &&
+	   ([controller runAtFrame:dueFrame func:streamDeadline arg:self] == 0))
+	    calloutPending = YES;
+    }
+
+    return;
+}
+
+
+/*
+ *  Copy data into the stream.  It goes to the bus a slot at a
+ *  time, so this only sleeps when every slot is already there.
+ */
+- (int)write:(unsigned char *)data length:(int)len
+{
+    unsigned int n;
+
+    if(len <= 0) return 0;
+
+    [writeLock lock];
+    if(closing == YES) {
+	[writeLock unlock];
+	return EINVAL;
+    }
+
+    while(len > 0) {
+	[self lockSlot];
+
+	n = [ring slotSize] - fill;
+	if(n > len) n = len;
+	bcopy(data, [ring slotData:slot] + fill, n);
+	fill += n;
+	data += n;
+	len -= n;
+
+	if(fill >= threshold) [self sendSlot:NO];
+	[streamLock unlock];
+    }
+
+    [writeLock unlock];
+
+    return 0;
+}
+
+
+/*  Send what's there and wait for all of it.  writeLock held. */
+- (int)drain
+{
+    usbRingHeader_t *header = [ring header];
+    BOOL done;
+
+    [streamLock lock];
+    [self sendSlot:NO];
+    [streamLock unlock];
+
+    for(;;) {
+	[streamLock lock];
+	[self reapSlots];
+	done = (header->reaped == header->posted);
+	[streamLock unlock];
+
+	if(done) break;
+	[ring waitForCompletion];
+    }
+
+    completionCode = pendingCode;
+    pendingCode = HC_CC_NO_ERROR;
+
+    return (completionCode == HC_CC_NO_ERROR) ? 0 : EIO;
+}
+
+
+/*
+ *  Send whatever is buffered and wait until the device has all
+ *  of it.  Returns EIO if anything written since the last flush
+ *  failed, see -completionCode.
+ */
+- (int)flush
+{
+    int result;
+
+    [writeLock lock];
+    result = [self drain];
+    [writeLock unlock];
+
+    return result;
+}
+
+
+- (int)completionCode
+{
+    return completionCode;
+}
+
+
+/*
+ *  No more writes.  Anything still in the fill slot is dropped,
+ *  so flush first.  The controller waits out a deadline callout
+ *  which may already be running before freeing the stream.
+ */
+- (void)close
+{
+    [writeLock lock];
+    closing = YES;
+
+    [streamLock lock];
+    slot = -1;
+    fill = 0;
+    calloutPending = NO;
+    [streamLock unlock];
+
+    [controller cancelFrameCallout:streamDeadline arg:self];
+    [writeLock unlock];
+
+    return;
+}
+
+
+/*
+ *  The deadline callout, in the I/O thread.  If the slot it was
+ *  set for has gone and a newer one is filling, wait for that
+ *  one's deadline instead.
+ */
+- (void)deadlineExpired:(usbFrame_t)frame
+{
+    [streamLock lock];
+
+    calloutPending = NO;
+    if((closing == NO) && (slot >= 0) && (fill > 0)) {
+	if(frame >= dueFrame)
+	    [self sendSlot:YES];
+	else if([controller runAtFrame:dueFrame func:streamDeadline arg:self] == 0)
+	    calloutPending = YES;
+    }
+
+    [streamLock unlock];
+
+    return;
+}
+
+
+@end
+
+
+static void streamDeadline(void *arg, usbFrame_t frame)
+{
+    [(USBStream *)arg deadlineExpired:frame];
+}
@@ -22,8 +22,28 @@
     volatile unsigned char *dataPacket;
     volatile unsigned int physDataPacket;
     unsigned int ndata,nalloced;
+
+    /*  Data buffer described by this TD, for byte counting */
+    unsigned int physBufferStart;
+    unsigned int bufferLength;
+
+@public
+    /*
+     *  Links for the queue and hash functions below, which are the
+     *  only things that should touch them.  A TD is on at most one
+     *  endpoint queue and one request at a time, and is found from
+     *  the done queue by its physical address.
+     */
+    USBTransfer *qNext, *qPrev;         /* Endpoint queue */
+    USBTransfer *rNext, *rPrev;         /* Request */
+    USBTransfer *hNext;                 /* Done queue hash chain */
+    unsigned int physTD;                /* Same as -physicalAddress */
+    id request;                         /* Request it's on, or nil */
+    struct usbTDHash *hash;             /* Hash it's in, or NULL */
 }
 
++ (unsigned int)numCreated;
+
 - init;
 - free;
 
@@ -37,6 +57,124 @@
 - (BOOL)deQueued;
 - (void)setDirection:(int)tdDir;
 
+- (void)setBuffer:(unsigned int)physStart length:(unsigned int)len;
+- (unsigned int)bytesTransferred;
+- (unsigned int)bytesRemaining;
+
 @end
 
 
+/*
+ *  Intrusive TD queues.  Endpoints and requests keep their TDs on
+ *  these instead of Lists, so queueing and retiring a TD is a few
+ *  pointer stores, with no searching and no messages sent.  The
+ *  owner of a queue serializes access to it; for requests and the
+ *  hash that's processedLock.
+ */
+typedef struct {
+    USBTransfer *head;
+    USBTransfer *tail;
+    int count;
+} usbTDQueue_t;
+
+static __inline__ void tdq_init(usbTDQueue_t *q)
+{
+    q->head = q->tail = nil;
+    q->count = 0;
+}
+
+/* Endpoint queues, through qNext/qPrev */
+static __inline__ void tdq_append(usbTDQueue_t *q, USBTransfer *t)
+{
+    t->qNext = nil;
+    t->qPrev = q->tail;
+    if(q->tail != nil) q->tail->qNext = t;
+    else q->head = t;
+    q->tail = t;
+    q->count++;
+}
+
+static __inline__ void tdq_remove(usbTDQueue_t *q, USBTransfer *t)
+{
+    if(t->qPrev != nil) t->qPrev->qNext = t->qNext;
+    else q->head = t->qNext;
+    if(t->qNext != nil) t->qNext->qPrev = t->qPrev;
+    else q->tail = t->qPrev;
+    t->qNext = t->qPrev = nil;
+    q->count--;
+}
+
+/* Request queues, through rNext/rPrev */
+static __inline__ void tdr_append(usbTDQueue_t *q, USBTransfer *t)
+{
+    t->rNext = nil;
+    t->rPrev = q->tail;
+    if(q->tail != nil) q->tail->rNext = t;
+    else q->head = t;
+    q->tail = t;
+    q->count++;
+}
+
+static __inline__ void tdr_remove(usbTDQueue_t *q, USBTransfer *t)
+{
+    if(t->rPrev != nil) t->rPrev->rNext = t->rNext;
+    else q->head = t->rNext;
+    if(t->rNext != nil) t->rNext->rPrev = t->rPrev;
+    else q->tail = t->rPrev;
+    t->rNext = t->rPrev = nil;
+    q->count--;
+}
+
+
+/*
+ *  TDs which belong to a request, by physical address, so the done
+ *  queue can be matched up without asking every request in turn.
+ *  TDs are 16-byte aligned, so the low bits carry nothing.
+ */
+#define TD_HASH_SIZE  256
+
+typedef struct usbTDHash {
+    USBTransfer *bucket[TD_HASH_SIZE];
+} usbTDHash_t;
+
+static __inline__ unsigned int td_hash_key(unsigned int physAddr)
+{
+    return ((physAddr >> 4) ^ (physAddr >> 12)) & (TD_HASH_SIZE - 1);
+}
+
+static __inline__ void td_hash_insert(usbTDHash_t *h, USBTransfer *t)
+{
+    unsigned int key = td_hash_key(t->physTD);
+
+    t->hNext = h->bucket[key];
+    h->bucket[key] = t;
+    t->hash = h;
+}
+
+static __inline__ void td_hash_remove(USBTransfer *t)
+{
+    USBTransfer **link;
+
+    if(t->hash == NULL) return;
+
+    for(link = &t->hash->bucket[td_hash_key(t->physTD)]; *link != nil; link = &(*link)->hNext) {
+	if(*link == t) {
+	    *link = t->hNext;
+	    break;
+	}
+    }
+    t->hNext = nil;
+    t->hash = NULL;
+}
+
+static __inline__ USBTransfer *td_hash_find(usbTDHash_t *h, unsigned int physAddr)
+{
+    USBTransfer *t;
+
+    for(t = h->bucket[td_hash_key(physAddr)]; t != nil; t = t->hNext)
+	if(t->physTD == physAddr) return t;
+
+    return nil;
+}
+
+
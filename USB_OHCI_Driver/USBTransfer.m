@@ -3,21 +3,46 @@
  * All rights reserved.
  */
 
+#import <machkit/NXLock.h>
 #import "USBTransfer.h"
+#import "TransferRequest.h"
 
 @implementation USBTransfer
 
+/*  How many TDs have ever been made, for the driver's statistics.
+ *  The I/O and install threads both make them.
+ */
+static unsigned int numCreated = 0;
+static NXLock *numCreatedLock = nil;
+
++ initialize
+{
+    if(numCreatedLock == nil) numCreatedLock = [[NXLock alloc] init];
+    return self;
+}
+
++ (unsigned int)numCreated
+{
+    return numCreated;
+}
+
+
 - init
 {
     unsigned int physReg,physAligned,offset;
     IOReturn ioerr;
 
     [super init];
+    [numCreatedLock lock];
+    numCreated++;
+    [numCreatedLock unlock];
     localData = NO;
     dataPacket = NULL;
     nalloced = 0;
     ndata = 0;
     physDataPacket = 0;
+    physBufferStart = 0;
+    bufferLength = 0;
 
     /* The -Physical- memory location must be aligned to 16-byte boundary */
     /* Allocate wired-down kernel memory */
@@ -44,28 +69,26 @@
     offset = physAligned - physReg;
     physicalAddress = physAligned;
 
-    descriptor = (td_t *)(bufstart + offset);
-
-    descriptor->dword0.field.undef1 = 0;
-    descriptor->dword0.field.bufferRounding = 1;
-    descriptor->dword0.field.directionPID = DIR_IN;
-    descriptor->dword0.field.delayInterrupt = NO_INTERRUPT;
-    descriptor->dword0.field.dataToggle = 0;
-    descriptor->dword0.field.errorCount = 0;
-    descriptor->dword0.field.conditionCode = 0xF;
+    qNext = qPrev = nil;
+    rNext = rPrev = nil;
+    hNext = nil;
+    physTD = physAligned;
+    request = nil;
+    hash = NULL;
 
-    descriptor->dword1.field.currentPointer = 0;
+    /* offset is in bytes, bufstart is an (unsigned int *) */
+    descriptor = (td_t *)((char *)bufstart + offset);
 
-    descriptor->dword2.field.undef1 = 0;
-    descriptor->dword2.field.nextTD = 0;
-
-    descriptor->dword3.field.bufferEnd = 0xFFFFFFFF;
+    td_fill(descriptor, td_flags(DIR_IN, NO_INTERRUPT, 0, 1), 0, 0xFFFFFFFF);
 
     return self;
 }
 
 - free
 {
+    /* Never leave a freed TD where the done queue can find it */
+    if(request != nil) [request removeTransfer:self];
+
     IOFree((void *)bufstart, (int)buflength);
     if(localData == YES) {
 	if(dataPacket != NULL)
@@ -113,8 +136,8 @@
     }
 
     ndata = nalloced;
-    descriptor->dword1.field.currentPointer = physDataPacket;
-    descriptor->dword3.field.bufferEnd = physDataPacket+nbytes-1;
+    descriptor->dword1.word = physDataPacket;
+    descriptor->dword3.word = physDataPacket+nbytes-1;
 
     localData = YES;
 
@@ -138,6 +161,44 @@
 }
 
 
+/*
+ *  Remember which data buffer this TD describes.  Only data
+ *  phase TDs are given a buffer here, so setup and status
+ *  TDs count as zero bytes.
+ */
+- (void)setBuffer:(unsigned int)physStart length:(unsigned int)len
+{
+    physBufferStart = physStart;
+    bufferLength = len;
+    return;
+}
+
+
+/*
+ *  Once the controller has retired this TD, currentPointer is
+ *  zero if the whole buffer was moved, otherwise it points at
+ *  the next byte which would have been transferred (pg 21 OHCI Spec).
+ */
+- (unsigned int)bytesTransferred
+{
+    unsigned int currentPointer;
+
+    if(bufferLength == 0) return 0;
+
+    currentPointer = descriptor->dword1.field.currentPointer;
+    if(currentPointer == 0) return bufferLength;
+
+    return currentPointer - physBufferStart;
+}
+
+
+/*  What the controller still has to move, 0 once it's retired */
+- (unsigned int)bytesRemaining
+{
+    return bufferLength - [self bytesTransferred];
+}
+
+
 - (td_t *)descriptor
 {
     return (td_t *)descriptor;
@@ -15,7 +15,11 @@
 #import "USBDevice.h"
 #import "USBEndpoint.h"
 #import "USBTransfer.h"
+#import "ohcireg.h"
 #import "TransferRequest.h"
+#import "USBBufferPool.h"
+#import "USBRing.h"
+#import "USBStream.h"
 
 #define OFF FALSE
 #define ON  TRUE
@@ -27,6 +31,21 @@
 
 #define MAXQUEUE 100
 
+/*
+ *  Bounce buffer size classes.  I/O requests of BOUNCE_THRESHOLD
+ *  bytes or less, or whose buffer isn't physically contiguous
+ *  where a packet needs it to be, are copied through one of these.
+ */
+#define NUM_BOUNCE_POOLS   3
+#define BOUNCE_THRESHOLD   512
+
+static unsigned int bounceSize[NUM_BOUNCE_POOLS]  = { 64, 512, 4096 };
+static int          bounceCount[NUM_BOUNCE_POOLS] = { 32,  16,    4 };
+
+/* TransferRequest pool sizes */
+#define REQUEST_POOL_INIT   8
+#define REQUEST_POOL_MAX    64
+
 static unsigned char balance[16] = {
     0x0, 0x8, 0x4, 0xC,
     0x2, 0xA, 0x6, 0xE,
@@ -54,11 +73,86 @@ static unsigned char balance[16] = {
 #define TIMEOUT_FIRED   900
 
 
+/* Valid hotplugLock values */
+#define HOTPLUG_EMPTY   1000
+#define HOTPLUG_PENDING 1100
+
+#define HOTPLUG_QUEUE_LENGTH  32
+#define HOTPLUG_WAIT          1000     /* ms a parameter read waits for an event */
+#define MAX_DRIVER_MATCH      32
+
+
+/*
+ *  Device teardown.  USB addresses 1-127 are handed out from a
+ *  bitmap and go back when a device is freed.  Before a device's
+ *  TDs are freed, the controller is given long enough to put any
+ *  it has retired on the done queue; it may hold them for up to
+ *  7 frames (DoneQueueInterruptCounter) before writing the done head.
+ */
+#define USB_MAX_ADDRESS     127
+#define DONE_QUEUE_FRAMES   8
+
+/*
+ *  Fault recovery.  The watchdog looks at the HCCA frame number every
+ *  WATCHDOG_INTERVAL seconds, and a controller that hasn't moved it
+ *  is reset as if it had reported Unrecoverable Error.
+ */
+#define WATCHDOG_INTERVAL   1
+
+/* How long, in 10ms steps, closing a ring waits for busy slots */
+#define RING_CLOSE_WAIT     100
+
+/* Slots in a write stream's ring, one filling and the rest on the bus */
+#define STREAM_SLOTS        4
+
+/*
+ *  Busy-poll completion.  A caller polling an endpoint looks at the
+ *  HCCA done head every POLL_STEP us.  TDs on a polled endpoint ask
+ *  for the done head to be written back in the frame they finish in.
+ */
+#define POLL_STEP           10
+#define POLL_DONE_DELAY     0
+#define DONE_DELAY          6
+
+
+/*
+ *  Frame clock.  FNO fires each time bit 15 of the frame number
+ *  flips, every 0x8000 frames.  Callouts are kept sorted by frame
+ *  and run from the SOF interrupt, which is only enabled while
+ *  there's a callout waiting.
+ */
+#define FRAME_HALF          0x8000
+#define FRAME_NS            1000000ULL     /* ns in one 1ms frame */
+#define MAX_FRAME_CALLOUTS  32
+
+
+/* Workload capture ring, in records */
+#define CAPTURE_RECORDS     1024
+
+typedef struct {
+    usbFrame_t frame;
+    usbFrameFunc_t func;
+    void *arg;
+} frameCallout_t;
+
+
+/* TransferRequest pool statistics */
+typedef struct {
+    int created;            /* Requests currently allocated     */
+    int inUse;              /* Requests handed out right now    */
+    int highWater;          /* Most ever handed out at once     */
+    int idle;               /* Requests sitting in the pool     */
+    unsigned int hits;      /* Allocations served from the pool */
+    unsigned int misses;    /* Allocations which needed a new one */
+} requestPoolStats_t;
+
+
 @interface UsbOHCI : IODirectDevice <OHCI_Interface>
 {
     /* Hardware Addresses */
     volatile vm_address_t HcBase;
     volatile unsigned int *physicalHcBase;
+    ohci_regs_t hcRegs;                 /* All register access goes through here */
     vm_address_t hccaBufferFree;
     volatile vm_address_t hccaBufferBase;
     volatile unsigned int physicalHCCABufferBase;
@@ -71,8 +165,12 @@ static unsigned char balance[16] = {
     unsigned int overCurrentMode;
     unsigned int powerOnDelay;
 
-    /* USB Device List */
+    /*  USB Device List.  Only the install thread adds or removes
+     *  devices, so it reads the list as it is.  Anyone else holds
+     *  deviceLock to look at it.
+     */
     List *usbDeviceList;
+    NXLock *deviceLock;
 
     /* USB ED Queue List */
     List *controlEDList;
@@ -85,6 +183,14 @@ static unsigned char balance[16] = {
     List *interrupt01EDList;
     List *isochronousEDList;
 
+    /*  Guards the order of bulkEDList, which changes as endpoints take
+     *  turns, and bulkParkedList, which holds endpoints taken out of
+     *  the hardware list until the controller has let go of them.
+     */
+    NXLock *bulkLock;
+    List *bulkParkedList;
+    BOOL bulkRelinkPending;
+
     /*
      *   IOThread synchronization -
      *      commandLock prevents more than one thread from
@@ -102,12 +208,83 @@ static unsigned char balance[16] = {
 
     List *usbCommandList;
     List *usbProcessedList;
+
+    /*  Shared rings.  Both lists are guarded by commandLock.  A ring's
+     *  requests stay on usbProcessedList from open to close.
+     *  ringInService is the ring the I/O thread took off doorbellList
+     *  and is queueing now, also under commandLock.
+     */
+    List *ringList;
+    List *doorbellList;
+    USBRing *ringInService;
+    unsigned int nextRingID;
+
+    /* Bulk OUT write streams, each on a ring of its own.  commandLock. */
+    List *streamList;
     List *errorTransferList;
     List *timeoutList;
 
+    /* Recycled TransferRequests, so steady state I/O doesn't allocate */
+    NXLock *poolLock;
+    List *requestPool;
+    requestPoolStats_t poolStats;
+
+    /* Every TD on a request, by physical address.  processedLock. */
+    usbTDHash_t tdHash;
+
+    /* Wired bounce buffers for small or awkward I/O */
+    USBBufferPool *bouncePool[NUM_BOUNCE_POOLS];
+
     msg_header_t machMessage;
     port_t msgPort;
 
+    /* Frame watchdog, delivered to the I/O thread as IO_TIMEOUT_MSG */
+    msg_header_t watchdogMessage;
+    unsigned int watchdogFrame;
+
+    /* Hot plug event queue and driver match table */
+    NXConditionLock *hotplugLock;
+    usbHotplugEvent_t hotplugQueue[HOTPLUG_QUEUE_LENGTH];
+    int hotplugHead;
+    int hotplugCount;
+    unsigned int hotplugSequence;
+    unsigned int hotplugDropped;
+
+    usbDriverMatch_t driverMatchTable[MAX_DRIVER_MATCH];
+    int numDriverMatches;
+
+    /* Frame clock, see -currentFrame */
+    NXLock *frameLock;
+    usbFrame_t frameBase;               /* Frames counted before the last controller reset */
+    usbFrame_t frameHigh;               /* Frame number at the last FNO, since reset       */
+    usbFrame_t frameAnchor;             /* A frame number ...                              */
+    ns_time_t frameAnchorTime;          /* ... and the time it was read                    */
+    frameCallout_t frameCallouts[MAX_FRAME_CALLOUTS];
+    int numFrameCallouts;
+    frameCallout_t runningCallout;      /* Being run by the I/O thread ...            */
+    BOOL calloutRunning;                /* ... if this is set                         */
+
+    /* Workload capture, off while captureRing is NULL */
+    NXLock *captureLock;
+    usbCaptureRecord_t *captureRing;
+    int captureHead;
+    int captureCount;
+    unsigned int captureDropped;
+    ns_time_t captureStart;
+
+    /* Running totals, counted from several threads so statsLock guards them */
+    NXLock *statsLock;
+    usbStatistics_t stats;
+    unsigned int statsTransferBase;
+    unsigned int statsRequestBase;
+
+    /* USB addresses in use, bit n for address n */
+    unsigned int addressMap[(USB_MAX_ADDRESS+32)/32];
+
+    /* Detached devices with no driver, waiting for the install thread to free */
+    NXLock *removeLock;
+    List *removeList;
+
     /*  Miscellaneous */
     BOOL ignoreRHSC;
 }
@@ -124,14 +301,61 @@ static unsigned char balance[16] = {
 - initOHCIRegistersFromDeviceDescription:(id)deviceDescription;
 
 - startHardware;
+- (BOOL)resetController;
+- (void)initOperationalRegisters;
+- (void)startSchedule;
+- (void)recoverController;
+- (void)failAllRequests:(int)completionCode;
+- (void)rebuildSchedule;
+- (void)relinkFrom:(USBEndpoint *)endpoint;
+- (void)watchdogFired;
 - enumerateDevices;
 - (int)installDeviceOnPort:(int)portnum;
 
 - (void)appendEndpoint:(USBEndpoint *)newEndpoint to:(List *)edList;
 - (void)removeEndpoint:(USBEndpoint *)thisEndpoint;
+- (void)waitFrames:(int)nframes;
+- (int)allocAddress;
+- (void)releaseAddress:(int)usbAddress;
+- (void)retireRequestsForDevice:(USBDevice *)device;
+- (void)removeDevice:(USBDevice *)device;
+- (void)reapDevices;
 - (void)insertInterruptEndpoint:(USBEndpoint *)newED atInterval:(int)intInterval;
+- (void)insertBulkEndpoint:(USBEndpoint *)newEndpoint;
+- (void)linkBulkEndpoint:(USBEndpoint *)endpoint;
+- (void)unlinkBulkEndpoint:(USBEndpoint *)endpoint;
+- (void)requeueBulkEndpoint:(USBEndpoint *)endpoint;
+- (void)relinkParkedEndpoints:(usbFrame_t)frame;
+- (void)bulkEndpointServed:(USBEndpoint *)endpoint;
+- (USBDevice *)deviceAtAddress:(int)usbAddress;
+
+- (TransferRequest *)allocTransferRequest;
+- (void)recycleTransferRequest:(TransferRequest *)transRequest;
+- (void)requestPoolStats:(requestPoolStats_t *)stats;
+
+- (BOOL)bufferIsContiguous:(unsigned char *)data length:(unsigned int)len maxPacket:(unsigned int)maxPacket;
+- (void)stageBounceBuffer:(TransferRequest *)transRequest;
+- (void)unstageBounceBuffer:(TransferRequest *)transRequest;
+
+- (int)prepareIO:(TransferRequest *)transRequest
+	  device:(USBDevice *)device
+	endpoint:(int)endpointNum
+       direction:(int)dataDir
+	    data:(unsigned char *)reqData
+	   ndata:(int)numdata;
+- (int)submitRequest:(TransferRequest *)transRequest timeOut:(int)hardTimeOut;
+- (void)finishRequest:(TransferRequest *)transRequest;
+- (void)waitForRequest:(TransferRequest *)transRequest;
+- (void)startRequest:(TransferRequest *)transRequest;
+- (void)completeRequest:(TransferRequest *)transRequest;
+
+- (void)serviceRing:(USBRing *)ring;
+- (USBRing *)ringWithID:(unsigned int)ringID;
+- (void)closeRingsForDevice:(USBDevice *)device;
+- (void)closeStreamsForDevice:(USBDevice *)device;
 
 - (int)purgeDoneQueue;
+- (void)retireShortRequest:(TransferRequest *)transRequest;
 - (void)processErrorTransfers;
 - (void)processTimeouts;
 - (void)pauseEndpoint:(USBEndpoint *)endPoint;
@@ -146,6 +370,27 @@ static unsigned char balance[16] = {
 - (void)activateDevice:(USBDevice *)device;
 - (void)ignoreRHSC:(BOOL)flag;
 
+- (void)postHotplugEvent:(int)event forDevice:(USBDevice *)device;
+- (BOOL)nextHotplugEvent:(usbHotplugEvent_t *)event wait:(BOOL)waitFlag;
+- (int)addDriverMatch:(usbDriverMatch_t *)match;
+- (char *)matchDriverForDevice:(USBDevice *)device;
+
+- (usbFrame_t)frameFromHardware;
+- (void)anchorFrameClock;
+- (void)serviceFrameClock:(unsigned int)interruptStatus;
+
+- (void)startCapture;
+- (void)stopCapture;
+- (void)captureRequest:(TransferRequest *)transRequest
+	       address:(int)usbAddress
+	      endpoint:(int)endpointNum
+		 start:(ns_time_t)startTime;
+- (unsigned int)readCapture:(unsigned int *)buffer count:(unsigned int)nwords;
+- (void)statistics:(usbStatistics_t *)statistics;
+- (void)resetStatistics;
+- (unsigned int)readSnapshot:(unsigned int *)buffer count:(unsigned int)nwords;
+- (void)snapshotEndpoint:(USBEndpoint *)endpoint list:(int)list into:(usbSnapshotED_t *)rec;
+
 
 
 /* External Interface Protocol */
@@ -170,6 +415,60 @@ static unsigned char balance[16] = {
 	     timeOut:(int)hardTimeOut
                 from:(id)sender;
 
+- (int)doIOonAddress:(int)usbAddress 
+            endpoint:(int)endpointNum  
+           direction:(int)dataDir 
+                data:(unsigned char *)reqData 
+               ndata:(int)numdata 
+              actual:(int *)nactual
+	     timeOut:(int)hardTimeOut
+                from:(id)sender;
+
+- (int)doTransactionOnAddress:(int)usbAddress
+		       phases:(usbPhase_t *)phases
+			count:(int)nphases
+		      timeOut:(int)hardTimeOut
+			 from:(id)sender;
+
+- (id)openRingOnAddress:(int)usbAddress
+	       endpoint:(int)endpointNum
+	      direction:(int)dataDir
+		  slots:(int)nslots
+		   from:(id)sender;
+- (int)ringDoorbell:(id)ring;
+- (void)closeRing:(id)ring from:(id)sender;
+
+- (id)openStreamOnAddress:(int)usbAddress
+		 endpoint:(int)endpointNum
+		threshold:(int)nbytes
+		 deadline:(int)msecs
+		     from:(id)sender;
+- (int)closeStream:(id)stream from:(id)sender;
+
+- (usbFrame_t)currentFrame;
+- (ns_time_t)timeOfFrame:(usbFrame_t)frame;
+- (usbFrame_t)frameAtTime:(ns_time_t)nsTime;
+- (int)runAtFrame:(usbFrame_t)frame func:(usbFrameFunc_t)func arg:(void *)arg;
+- (void)cancelFrameCallout:(usbFrameFunc_t)func arg:(void *)arg;
+
+- (int)setBulkPriority:(int)priority
+		weight:(int)weight
+	     onAddress:(int)usbAddress
+	      endpoint:(int)endpointNum
+	     direction:(int)dataDir
+		  from:(id)sender;
+
+- (int)bulkStats:(usbBulkStats_t *)stats
+       onAddress:(int)usbAddress
+	endpoint:(int)endpointNum
+       direction:(int)dataDir;
+
+- (int)setPollLimit:(int)usec
+	  onAddress:(int)usbAddress
+	   endpoint:(int)endpointNum
+	  direction:(int)dataDir
+	       from:(id)sender;
+
 
 
 
@@ -196,6 +495,15 @@ static unsigned char balance[16] = {
 - (NXLock *)timeLock;
 
 
+/* Device parameters */
+- (IOReturn)getIntValues:(unsigned int *)parameterArray
+	    forParameter:(IOParameterName)parameterName
+		   count:(unsigned int *)count;
+- (IOReturn)setIntValues:(unsigned int *)parameterArray
+	    forParameter:(IOParameterName)parameterName
+		   count:(unsigned int)count;
+
+
 @end
 
 
@@ -63,7 +63,9 @@ static char *usberrstr[] = {
   "BUFFER UNDERRUN",
   "",
   "NOT ACCESSED",
-  "TIMEOUT"
+  "TIMEOUT",
+  "DEVICE REMOVED",
+  "CONTROLLER RESET"
 };
 
 static UsbOHCI *ohciDriver;
@@ -188,10 +190,13 @@ static instPort;
 {
     IOReturn ioerr;
     unsigned int baseAddress,irq;
+    TransferRequest *transRequest;
+    int i;
     static void timeoutdaemon(void *arg);
     static void plumberdaemon(void *arg);
     static void installdaemon(void *driver);
     static void setIgnoreRHSC(void *arg);
+    static void usbWatchdog(void *arg);
 
     instPort = 0;
 
@@ -208,6 +213,13 @@ static instPort;
         return nil;
     }
 
+    /* The descriptor builders in ohci.h assume the bitfield layout */
+    if(!ohci_layout_ok()) {
+        IOLog("usb - Descriptor bitfields laid out differently than ohci.h expects\n");
+	IOSleep(100);
+        return nil;
+    }
+
     /* At this point, all OHCI Registers can be accessed by the driver */
 
     if([self initOHCIRegistersFromDeviceDescription:deviceDescription]==nil) {
@@ -239,8 +251,32 @@ static instPort;
 
     usbCommandList = [[List alloc] init];
     usbProcessedList = [[List alloc] init];
+    ringList = [[List alloc] init];
+    doorbellList = [[List alloc] init];
+    ringInService = nil;
+    nextRingID = 1;
+    streamList = [[List alloc] init];
     errorTransferList = [[List alloc] init];
     timeoutList = [[List alloc] init];
+
+    /* Pre-load the TransferRequest pool */
+    poolLock = [[NXLock alloc] init];
+    requestPool = [[List alloc] initCount:REQUEST_POOL_MAX];
+    bzero(&poolStats, sizeof(requestPoolStats_t));
+    bzero(&tdHash, sizeof(usbTDHash_t));
+    for(i=0; i<REQUEST_POOL_INIT; i++) {
+	transRequest = [[TransferRequest alloc] init];
+	[transRequest tdHash:&tdHash];
+	[requestPool addObject:transRequest];
+	poolStats.created++;
+    }
+
+    /* Bounce buffers, in each size class */
+    for(i=0; i<NUM_BOUNCE_POOLS; i++) {
+	bouncePool[i] = [[USBBufferPool alloc] initWithSize:bounceSize[i] count:bounceCount[i]];
+	if(bouncePool[i] == nil)
+	    IOLog("usb -  Can't allocate %d byte bounce buffers\n",bounceSize[i]);
+    }
     
     if([self startIOThread] != IO_R_SUCCESS) {
 	IOLog("usb -  Can't start IO Thread\n");
@@ -276,18 +312,50 @@ static instPort;
     timeoutLock = [[NXConditionLock alloc] initWith:TIMEOUT_IDLE];
     IOForkThread(timeoutdaemon, self);
 
-    /* Spin off a thread to handle hot device installation */
+    /* Address 0 is the default address, never handed out */
+    bzero(addressMap, sizeof(addressMap));
+    addressMap[0] = 1;
+    removeLock = [[NXLock alloc] init];
+    removeList = [[List alloc] init];
+
+    /* Spin off a thread to handle hot device installation, and removal */
     installLock = [[NXConditionLock alloc] initWith:INSTALL_IDLE];
     IOForkThread(installdaemon, self);
 
+    /* Hot plug events for user space */
+    hotplugLock = [[NXConditionLock alloc] initWith:HOTPLUG_EMPTY];
+    hotplugHead = 0;
+    hotplugCount = 0;
+    hotplugSequence = 0;
+    hotplugDropped = 0;
+    numDriverMatches = 0;
+
+    /* Bus time starts at frame zero */
+    frameLock = [[NXLock alloc] init];
+    frameBase = 0;
+    frameHigh = 0;
+    numFrameCallouts = 0;
+    calloutRunning = NO;
+
+    bulkLock = [[NXLock alloc] init];
+    bulkParkedList = [[List alloc] init];
+    bulkRelinkPending = NO;
+
+    /* Capture is off until someone asks */
+    captureLock = [[NXLock alloc] init];
+    captureRing = NULL;
+    statsLock = [[NXLock alloc] init];
+    [self resetStatistics];
+
 
     /* Initialize usb hardware registers, begin USB frame processing */
     [self startHardware];
 
     /* Turn on interrupts, ignore changes on Root Hub for now */
     ignoreRHSC = YES;
-    *((unsigned int *)(HcBase+HcInterruptDisable)) = HC_ALL_INTRS;
-    *((unsigned int *)(HcBase+HcInterruptEnable)) = HC_SO | HC_WDH | HC_RD | HC_UE | HC_RHSC | HC_MIE;
+    ohci_intr_disable(&hcRegs, HC_ALL_INTRS);
+    ohci_intr_enable(&hcRegs, HC_NORMAL_INTRS);
+    ohci_intr_master(&hcRegs, YES);
 
     /* Set Ports to individual power control */
     [self initPortPower];
@@ -299,13 +367,19 @@ static instPort;
     [self enumerateDevices];
 
     /* Clear interrupt conditions  */
-    *((unsigned int *)(HcBase+HcRhPortStatus(1))) = HC_CSC | HC_PESC | HC_PSSC | HC_POCIC | HC_PRSC;
-    *((unsigned int *)(HcBase+HcRhPortStatus(2))) = HC_CSC | HC_PESC | HC_PSSC | HC_POCIC | HC_PRSC;
-    *((unsigned int *)(HcBase+HcInterruptStatus)) = 0x7F;
+    ohci_write(&hcRegs, HcRhPortStatus(1), HC_CSC | HC_PESC | HC_PSSC | HC_POCIC | HC_PRSC);
+    ohci_write(&hcRegs, HcRhPortStatus(2), HC_CSC | HC_PESC | HC_PSSC | HC_POCIC | HC_PRSC);
+    ohci_intr_ack(&hcRegs, 0x7F);
 
     /* Now we can watch for Hub changes */
     IOScheduleFunc(setIgnoreRHSC, self, 30);
 
+    /* And for a controller that stops */
+    watchdogMessage = machMessage;
+    watchdogMessage.msg_id = IO_TIMEOUT_MSG;
+    watchdogFrame = ~0;
+    IOScheduleFunc(usbWatchdog, self, WATCHDOG_INTERVAL);
+
     /*
      *  Controller is hot, devices are installed.
      *  WE'RE OUT OF HERE!!
@@ -423,6 +497,7 @@ static instPort;
     }
 
     HcBase = (vm_address_t)virtual;
+    ohci_reg_init(&hcRegs, (volatile unsigned int *)HcBase);
 
     return baseAddress;
 }
@@ -450,7 +525,7 @@ static instPort;
     
 
     /* Check OHCI Revision number.  Must be 0x10 */
-    revision = *((unsigned int *)(HcBase + HcRevision));
+    revision = ohci_read(&hcRegs, HcRevision);
     revision &= 0x000000FF;
 
     if(revision != 0x10) {
@@ -500,6 +575,7 @@ static instPort;
 
     /* Initialize the device Endpoint lists */
     usbDeviceList = [[List alloc] init];
+    deviceLock = [[NXLock alloc] init];
 
     controlEDList = [[List alloc] init];
     bulkEDList = [[List alloc] init];
@@ -733,49 +809,102 @@ static instPort;
 
 - startHardware
 {
-    int i,iwait;
-    unsigned int  controlReg;
-    unsigned int  periodValue,maxPacket;
-    unsigned int  status;
-    unsigned int  physControlHead,physBulkHead;
+    /*
+     *  Keep the frame clock going across the reset.  The controller's
+     *  frame number starts over at zero, so fold everything counted so
+     *  far into frameBase.
+     */
+    [frameLock lock];
+    frameBase = [self frameFromHardware];
+    frameHigh = 0;
+    *((unsigned int *)(hccaBufferBase + HccaFrameNumber)) = 0;
+    [frameLock unlock];
 
     /*  Now - reset controller and initialize its registers */
-    *((unsigned int *)(HcBase+HcControl)) = HC_FS_RESET;
+    ohci_set_control(&hcRegs, HC_FS_RESET);
     IOSleep(100);
 
+    if([self resetController] == NO) {
+	IOLog("usb -  TIMEOUT ERROR Resetting Host Controller\n");
+	IOSleep(100);
+    }
+
+    /* We're now in SUSPEND mode.  We have 2ms to complete initialization */
+    [self initOperationalRegisters];
+
+    /* Disable USB interrupts till we're ready */
+    ohci_intr_disable(&hcRegs, HC_ALL_INTRS);
+    
+    /* Clear the interrupt status port */
+    ohci_intr_ack(&hcRegs, HC_ALL_INTRS);
+    
+    /*  Start that puppy up!!!   */
+    [self startSchedule];
+
+    [frameLock lock];
+    [self anchorFrameClock];
+    [frameLock unlock];
+
+    /* Done */
+
+    return self;
+}
+
+
+/*
+ *  Host Controller Reset command.  Leaves the controller in SUSPEND
+ *  with its registers at their defaults, and the root hub and the
+ *  bus left alone, so devices keep their addresses if the controller
+ *  is running again within 2ms.  Returns NO if the reset didn't finish.
+ */
+- (BOOL)resetController
+{
+    unsigned int status;
+    int iwait;
+
     /*  Perform a Host Controller Reset command */
-    *((unsigned int *)(HcBase+HcCommandStatus)) = HC_HCR;
+    ohci_command(&hcRegs, HC_HCR);
     for(iwait=0; iwait<20; iwait++) {
 	IODelay(10);
-	status = (*((unsigned int *)(HcBase+HcCommandStatus))) & HC_HCR;
+	status = ohci_read(&hcRegs, HcCommandStatus) & HC_HCR;
 	if(!status) break;
     }
 
-    if(status) {
-	IOLog("usb -  TIMEOUT ERROR Resetting Host Controller\n");
-	IOSleep(100);
-    }
+    /* Reset put HcControl and HcInterruptEnable back to their defaults */
+    ohci_reg_resync(&hcRegs);
 
-    /* We're now in SUSPEND mode.  We have 2ms to complete initialization */
+    return (status == 0);
+}
 
-    *((unsigned int *)(HcBase + HcHCCA)) = physicalHCCABufferBase;
+
+/*
+ *  Point a freshly reset controller at the HCCA and the ED lists,
+ *  which are all in our memory and survive the reset.
+ */
+- (void)initOperationalRegisters
+{
+    int i;
+    unsigned int  periodValue,maxPacket;
+    unsigned int  physControlHead,physBulkHead;
+
+    ohci_write(&hcRegs, HcHCCA, physicalHCCABufferBase);
 
     /* Set HcPeriodicStart to have a value of 90% of the FrameInterval field of HcFmInterval */
     periodValue = FRAME_INTERVAL * 9 / 10;
-    *((unsigned int *)(HcBase+HcPeriodicStart)) = periodValue;
+    ohci_write(&hcRegs, HcPeriodicStart, periodValue);
 
     /* This value is calculated like this in both the Linux and BSD drivers */
     maxPacket = ((FRAME_INTERVAL - 210) * 6 / 7) << 16;
-    *((unsigned int *)(HcBase+HcFmInterval)) = maxPacket | FRAME_INTERVAL;
+    ohci_write(&hcRegs, HcFmInterval, maxPacket | FRAME_INTERVAL);
 
-    *((unsigned int *)(HcBase+HcLSThreshold)) = 1576;
+    ohci_write(&hcRegs, HcLSThreshold, 1576);
 
     /* Set ED Head registers here */
     physControlHead = [[controlEDList objectAt:0] physicalAddress];
-    *((unsigned int *)(HcBase + HcControlHeadED)) = (unsigned int)physControlHead;
+    ohci_write(&hcRegs, HcControlHeadED, physControlHead);
 
     physBulkHead = [[bulkEDList objectAt:0] physicalAddress];
-    *((unsigned int *)(HcBase + HcBulkHeadED)) = (unsigned int)physBulkHead;
+    ohci_write(&hcRegs, HcBulkHeadED, physBulkHead);
 
     /*
      *  Fill Interrupt registers in HCCA area with place-holder EDs
@@ -789,24 +918,191 @@ static instPort;
 	    [(USBEndpoint *)[interrupt32EDList objectAt:2*i+1] physicalAddress];
     }
 
-    /* Disable USB interrupts till we're ready */
-    *((unsigned int *)(HcBase+HcInterruptDisable)) = HC_ALL_INTRS;
-    
-    /* Clear the interrupt status port */
-    *((unsigned int *)(HcBase+HcInterruptStatus)) = HC_ALL_INTRS;
-    
-    /* Set proper List Processing mask and Operational bits in Control Register */
-    controlReg = *((unsigned int *)(HcBase+HcControl));
-    controlReg &= ~(HC_CBSR_MASK | HC_LES | HC_FS_MASK | HC_IR);
-    controlReg |= HC_PLE | HC_IE | HC_CLE | HC_BLE | HC_RATIO_1_4 | HC_FS_OPERATIONAL;
+    return;
+}
 
-    /*  Start that puppy up!!!   */
-    *((unsigned int *)(HcBase+HcControl)) = controlReg;
+
+/* Set proper List Processing mask and Operational bits in Control Register */
+- (void)startSchedule
+{
+    ohci_control_update(&hcRegs, HC_CBSR_MASK | HC_LES | HC_FS_MASK | HC_IR,
+			HC_PLE | HC_IE | HC_CLE | HC_BLE | HC_RATIO_1_4 | HC_FS_OPERATIONAL);
     IODelay(10);
 
-    /* Done */
+    return;
+}
 
-    return self;
+
+/*
+ *  Get a faulted or hung controller going again without touching
+ *  the bus.  The schedule lives in our memory, so the controller is
+ *  reset and pointed back at it, with every ED link rewritten from
+ *  the kernel's own lists in case the fault was a bad pointer.
+ *  Requests in flight fail with CC_HC_RESET; their TDs may have been
+ *  half done.  Devices stay installed, unless their port dropped out.
+ *  I/O thread only, so nothing new gets queued while this runs.
+ */
+- (void)recoverController
+{
+    unsigned int intrMask;
+    int iport;
+
+    IOLog("usb - resetting controller\n");
+    [statsLock lock];
+    stats.recoveries++;
+    [statsLock unlock];
+
+    /* Keep what was enabled, HC_SF comes and goes with frame callouts */
+    intrMask = ohci_intr_enabled(&hcRegs);
+    ohci_intr_disable(&hcRegs, HC_ALL_INTRS);
+
+    /*  Stop list processing and give it a frame to let go of the
+     *  lists.  A controller which has taken an Unrecoverable Error
+     *  has stopped already, and one whose frame counter is stuck
+     *  isn't going anywhere.
+     */
+    ohci_control_clear(&hcRegs, HC_LES);
+    IODelay(1000);
+
+    [frameLock lock];
+    frameBase = [self frameFromHardware];
+    frameHigh = 0;
+    *((unsigned int *)(hccaBufferBase + HccaFrameNumber)) = 0;
+    [frameLock unlock];
+
+    /*  All the slow work comes before the reset.  After it the
+     *  controller sits in USBSUSPEND, and has to be back in
+     *  USBOPERATIONAL within 2ms.
+     */
+    [self failAllRequests:CC_HC_RESET];
+    [self rebuildSchedule];
+
+    /* A polling caller may be looking at the done head */
+    [processedLock lock];
+    *((unsigned int *)(hccaBufferBase + HccaDoneHead)) = 0;
+    [processedLock unlock];
+
+    if([self resetController] == NO)
+	IOLog("usb -  TIMEOUT ERROR Resetting Host Controller\n");
+
+    [self initOperationalRegisters];
+    ohci_intr_ack(&hcRegs, HC_ALL_INTRS);
+    [self startSchedule];
+
+    [frameLock lock];
+    [self anchorFrameClock];
+    [frameLock unlock];
+
+    /*  The reset cleared HcInterruptEnable.  A frame callout may have
+     *  come or gone since intrMask was taken, so HC_SF follows the
+     *  table rather than the old mask.
+     */
+    ohci_intr_enable(&hcRegs, intrMask & ~(HC_MIE | HC_SF));
+    [frameLock lock];
+    if(numFrameCallouts > 0)
+	ohci_intr_enable(&hcRegs, HC_SF);
+    [frameLock unlock];
+    ohci_intr_master(&hcRegs, YES);
+
+    /* Anything whose port was disabled has lost its address */
+    for(iport=1; iport<=numDownstreamPorts; iport++) {
+	if((ohci_read(&hcRegs, HcRhPortStatus(iport)) & HC_PES) == 0)
+	    [self idleDeviceOnPort:iport];
+    }
+
+    watchdogFrame = ~0;
+
+    return;
+}
+
+
+/*
+ *  Fail every request with TDs on the hardware, then free those TDs
+ *  and restart each endpoint on its blank tail TD.  List processing
+ *  must be stopped.
+ */
+- (void)failAllRequests:(int)completionCode
+{
+    TransferRequest *transRequest;
+    USBDevice *device;
+    int itr,idev,iep;
+    static void usbTimeOut(void *);
+
+    /*  The plumber and timeout threads have nothing left to retire.
+     *  They only claim a request off their list with processedLock
+     *  held, so one they're part way through is left alone.
+     */
+    [processedLock lock];
+
+    [errorLock lock];
+    [errorTransferList empty];
+    [errorLock unlock];
+
+    [timeLock lock];
+    [timeoutList empty];
+    [timeLock unlock];
+
+    for(itr=0; itr<[usbProcessedList count]; itr++) {
+	transRequest = [usbProcessedList objectAt:itr];
+	if([transRequest numTDsQueued] == 0) continue;
+
+	if([transRequest expireTime] > 0)
+	    IOUnscheduleFunc(usbTimeOut, transRequest);
+
+	/* The endpoint frees them below */
+	while([transRequest numTDsQueued] > 0)
+	    [transRequest removeTransferAt:0];
+
+	[transRequest completionCode:completionCode];
+	[self completeRequest:transRequest];
+    }
+
+    [deviceLock lock];
+    for(idev=0; idev<[usbDeviceList count]; idev++) {
+	device = [usbDeviceList objectAt:idev];
+	for(iep=0; iep<=[device numEndpoints]; iep++)
+	    [(USBEndpoint *)[device endpointAtIndex:iep] flushTransfers];
+    }
+    [deviceLock unlock];
+
+    [processedLock unlock];
+
+    return;
+}
+
+
+/*
+ *  Rewrite every ED's nextED from the kernel's prev/next pointers,
+ *  which the controller can't touch.
+ */
+- (void)rebuildSchedule
+{
+    int i;
+
+    [self relinkFrom:[controlEDList objectAt:0]];
+
+    [bulkLock lock];
+    [self relinkFrom:[bulkEDList objectAt:0]];
+    [bulkLock unlock];
+
+    /* Every branch of the interrupt tree starts at a 32ms place-holder */
+    for(i=0; i<[interrupt32EDList count]; i++)
+	[self relinkFrom:[interrupt32EDList objectAt:i]];
+
+    return;
+}
+
+
+- (void)relinkFrom:(USBEndpoint *)endpoint
+{
+    USBEndpoint *next;
+
+    for(; endpoint != nil; endpoint = next) {
+	next = [endpoint nextEndpoint];
+	[endpoint descriptor]->dword3.word = (next != nil) ? ([next physicalAddress] & 0xFFFFFFF0) : 0;
+    }
+
+    return;
 }
 
 
@@ -821,14 +1117,14 @@ static instPort;
     unsigned int descAValue;
 
     /* Set individual port power control, See OHCI Spec page 124 */
-    descAValue = *((unsigned int *)(HcBase+HcRhDescriptorA));
+    descAValue = ohci_read(&hcRegs, HcRhDescriptorA);
 
     /* Assign value to proper bits */
     descAValue |= HC_PSM;
     descAValue &= ~(HC_NPS);
 
     /* Write value to register */
-    *((unsigned int *)(HcBase+HcRhDescriptorA)) = descAValue;
+    ohci_write(&hcRegs, HcRhDescriptorA, descAValue);
     
     return;
 }
@@ -838,7 +1134,7 @@ static instPort;
 {
     unsigned int descAValue,descBValue;
 
-    descAValue = *((unsigned int *)(HcBase+HcRhDescriptorA));
+    descAValue = ohci_read(&hcRegs, HcRhDescriptorA);
     
     numDownstreamPorts = HC_GET_NDP(descAValue);
 
@@ -855,11 +1151,11 @@ static instPort;
 
 
     /* Set Individual Port Power Control mask for all downstream ports */
-    descBValue = *((unsigned int *)(HcBase+HcRhDescriptorB));
+    descBValue = ohci_read(&hcRegs, HcRhDescriptorB);
     descBValue |= 0xFFFF0000;
 
     /* Write value to register */
-    *((unsigned int *)(HcBase+HcRhDescriptorB)) = descBValue;
+    ohci_write(&hcRegs, HcRhDescriptorB, descBValue);
 
     return;
 }
@@ -875,7 +1171,7 @@ static instPort;
     for(iport=1; iport<=numDownstreamPorts; iport++) {
 
         /* Set Port Power */
-        *((unsigned int *)(HcBase+HcRhPortStatus(iport))) = HC_SPP;
+        ohci_write(&hcRegs, HcRhPortStatus(iport), HC_SPP);
 
 	/* Wait 10 ms */
 	IOSleep(10);
@@ -887,7 +1183,7 @@ static instPort;
 	}
 
 	/* Clear Connect status change bit */
-	*((unsigned int *)(HcBase+HcRhPortStatus(iport))) = HC_CSC;
+	ohci_write(&hcRegs, HcRhPortStatus(iport), HC_CSC);
     }
     
     return self;
@@ -924,12 +1220,12 @@ static instPort;
     }
 
     /* Query Port Power Status */
-    powerStat = *((unsigned int *)(HcBase+HcRhPortStatus(devPort)));
+    powerStat = ohci_read(&hcRegs, HcRhPortStatus(devPort));
     powerStat = ((powerStat & HC_PPS) == HC_PPS);
 
     if(powerStat == OFF) {
         /* Set Port Power */
-        *((unsigned int *)(HcBase+HcRhPortStatus(devPort))) = HC_SPP;
+        ohci_write(&hcRegs, HcRhPortStatus(devPort), HC_SPP);
 
 	/* Wait 3 ms */
 	IOSleep(3);
@@ -942,7 +1238,7 @@ static instPort;
     }
 
     /* Enable Port */
-    *((unsigned int *)(HcBase+HcRhPortStatus(devPort))) = HC_SPE;
+    ohci_write(&hcRegs, HcRhPortStatus(devPort), HC_SPE);
     IOSleep(2);
 
     /* Reset port, HC_SPR is Host Controller Set Port Reset  */
@@ -956,9 +1252,11 @@ static instPort;
      */
     newDevice = [[USBDevice alloc] init];
     controlEndpoint = [newDevice controlEndpoint];
+    [controlEndpoint type:CONTROL_TYPE];
 
+    [deviceLock lock];
     [usbDeviceList addObject:newDevice];
-    usbAddress = [usbDeviceList count];
+    [deviceLock unlock];
 
     /* We'll need this later for initializing device endpoints */
     devSpeed = [self deviceSpeed:devPort];
@@ -986,6 +1284,7 @@ static instPort;
 
     if(usberr != 0) {
         IOLog("usb - can't clear possible endpoint halt condition\n");
+	[self removeDevice:newDevice];
         return -1;
     }
 
@@ -1001,8 +1300,7 @@ static instPort;
     reqData = IOMalloc(DV_DESC_LENGTH);
     if(reqData == NULL) {
         IOLog("usb -  Kernel error allocating memory buffer for Device Descriptor\n");
-	[usbDeviceList removeObject:newDevice];
-        [newDevice free];
+	[self removeDevice:newDevice];
 
 	return -1;
     }
@@ -1024,8 +1322,8 @@ static instPort;
     
     if(usberr != 0) {
         IOLog("usb - can't get device descriptor, error %d\n",usberr);
-	[usbDeviceList removeObject:newDevice];
-        [newDevice free];
+	IOFree(reqData,DV_DESC_LENGTH);
+	[self removeDevice:newDevice];
 
 	return -1;
     }
@@ -1053,6 +1351,9 @@ static instPort;
     maxPacketSize = ((deviceDescriptor_t *)reqData)->maxPacketSize;
     [controlEndpoint setMaxPacketSize:maxPacketSize];
 
+    /* Keep the descriptor around for hot plug events and driver matching */
+    [newDevice setDeviceDescriptor:(deviceDescriptor_t *)reqData];
+
 
     /* Query device for Short Configuration Descriptor */
     devRequest.bmRequestType = UT_READ_DEVICE;
@@ -1075,8 +1376,8 @@ static instPort;
 
     if(usberr != 0) {
         IOLog("usb - can't get config descriptor, error %d\n",usberr);
-	[usbDeviceList removeObject:newDevice];
-        [newDevice free];
+	IOFree(reqData,CF_DESC_LENGTH);
+	[self removeDevice:newDevice];
 
 	return -1;
     }
@@ -1110,8 +1411,8 @@ static instPort;
 
     if(usberr != 0) {
         IOLog("usb - can't get long config descriptor, error %d\n",usberr);
-	[usbDeviceList removeObject:newDevice];
-        [newDevice free];
+	IOFree(reqData,configSize);
+	[self removeDevice:newDevice];
 
 	return -1;
     }
@@ -1158,6 +1459,7 @@ static instPort;
     for(idev=0; idev<ndevs; idev++) {
         USBDevice *localDev = [usbDeviceList objectAt:idev];
 	if([localDev hardwareIsUp] == YES) continue;
+	if([localDev hasDeviceDriver] == NO) continue;     /* Being freed */
 	if([localDev usbClass] != deviceClass) continue;
 	if([localDev usbSubClass] != deviceSubClass) continue;
 
@@ -1193,8 +1495,11 @@ static instPort;
 		                  timeOut:0
                                      from:self];
 
+	IOFree(reqData, configSize);
+
 	if(usberr != 0) {
 	    IOLog("usb - can't restore usb address, error %d\n",usberr);
+	    [self removeDevice:newDevice];
 	    return -1;
 	}
 
@@ -1207,34 +1512,11 @@ static instPort;
 	/* Set hardware port number */
 	[oldDevice hardwareHubPort:devPort];
 
-#if 0
-	/* Remove current control endpoint from chain */
-	IOLog("Removing redundant endpoint\n");
-	[self removeLastEndpointFrom:controlEDList];
-
-	/* Remove and free current device from usb device list */
-	IOLog("Removing device from list \n");
-	[usbDeviceList removeObject:newDevice];
-	[newDevice free];
-#else
-	/*
-	 *  NOTE:   The code above crashes my system hard.  And I've
-	 *          tried about everything known to man to cure whatever
-	 *          the problem is.  No luck.  So, I'm just going to leave
-	 *          the useless node in the chain and set the device's
-	 *          parameters to impossible values so it simply can't be
-	 *          accessed.
-	 *
-	 *  Drat!
-	 */
-	[newDevice usbAddress:127];
-	[newDevice hasDeviceDriver:YES];
-	[newDevice hardwareIsUp:YES];
-	[newDevice hardwareHubPort:999];
-	[newDevice setUsbClass:99999];
-	[newDevice setUsbSubClass:99999];
-	[newDevice deviceDriver:nil];
-#endif
+	/* Tell user space it's back */
+	[self postHotplugEvent:USB_EVENT_ATTACH forDevice:oldDevice];
+
+	/* The new device was only ever a stand-in for the old one */
+	[self removeDevice:newDevice];
 
 	/* Check for a HALTED pipe? */
 
@@ -1244,6 +1526,14 @@ static instPort;
 
     /* Set USB Address for this Device, see page 236 USB Book */
 
+    usbAddress = [self allocAddress];
+    if(usbAddress == 0) {
+        IOLog("usb - no free usb addresses\n");
+	IOFree(reqData, configSize);
+	[self removeDevice:newDevice];
+	return -1;
+    }
+
     devRequest.bmRequestType = UT_WRITE_DEVICE;
     devRequest.bRequest = UR_SET_ADDRESS;
     devRequest.wValue.word = usbAddress;
@@ -1259,8 +1549,9 @@ static instPort;
 
     if(usberr != 0) {
         IOLog("usb - can't set usb address, error %d\n",usberr);
-	[usbDeviceList removeObject:newDevice];
-        [newDevice free];
+	IOFree(reqData, configSize);
+	[self releaseAddress:usbAddress];
+	[self removeDevice:newDevice];
 
 	return -1;
     }
@@ -1331,7 +1622,7 @@ static instPort;
 	    [newEndpoint setEndpointFormat:0];
 	    [newEndpoint setEndpointDir:endpointDir];
 	    [newEndpoint type:BULK_TYPE];
-	    [self appendEndpoint:newEndpoint to:bulkEDList];
+	    [self insertBulkEndpoint:newEndpoint];
 	    break;
 
 	  case 3:
@@ -1361,6 +1652,9 @@ static instPort;
     [newDevice hubAddress:0];                /* Connected to Root hub       */
     [newDevice hardwareHubPort:devPort];     /* Needed in case disconnected */
 
+    /* Let the hot plug daemon know it can load a driver */
+    [self postHotplugEvent:USB_EVENT_ATTACH forDevice:newDevice];
+
     return 0;
 }    
 
@@ -1368,20 +1662,32 @@ static instPort;
 
 
 
+/*
+ *  A device has been unplugged.  A device with a driver is only
+ *  idled, so it can be re-activated if it comes back.  One without
+ *  is handed to the install thread to be freed, since that has to
+ *  wait out a few frames and this is the I/O thread.
+ */
 - (void)idleDeviceOnPort:(int)portnum
 {
     USBDevice *device;
     int idev, ndevs;
 
-    /* Find out which device is on this port */
+    /*  Find out which device is on this port.  deviceLock is held
+     *  throughout, so the install thread can't be taking it down.
+     */
+    [deviceLock lock];
     ndevs = [usbDeviceList count];
     for(idev=0; idev<ndevs; idev++) {
       device = [usbDeviceList objectAt:idev];
-      if([device hardwareHubPort] == portnum)
+      if(([device hardwareHubPort] == portnum) && ([device hardwareIsUp] == YES))
 	break;
     }
     
-    if(idev >= ndevs) return;
+    if(idev >= ndevs) {
+	[deviceLock unlock];
+	return;
+    }
 
     /* Mark the device as not up */
     [device hardwareIsUp:NO];
@@ -1389,6 +1695,16 @@ static instPort;
     /* Disable endpoints */
     [device idleEndpoints];
 
+    [self postHotplugEvent:USB_EVENT_DETACH forDevice:device];
+
+    if([device hasDeviceDriver] == NO) {
+	[removeLock lock];
+	[removeList addObjectIfAbsent:device];
+	[removeLock unlock];
+	[installLock unlockWith:INSTALL_NEEDED];
+    }
+    [deviceLock unlock];
+
     /* Done */
     return;
 }
@@ -1413,6 +1729,158 @@ static instPort;
 }
 
 
+
+/*
+ *  Queue a hot plug event for user space.  If nobody is reading
+ *  them, the oldest event is dropped to make room.  This is called
+ *  from the IO thread on a disconnect, so it mustn't block for long.
+ */
+- (void)postHotplugEvent:(int)event forDevice:(USBDevice *)device
+{
+    usbHotplugEvent_t *newEvent;
+    deviceDescriptor_t *desc = [device deviceDescriptor];
+    char *driverName;
+
+    [hotplugLock lock];
+
+    if(hotplugCount >= HOTPLUG_QUEUE_LENGTH) {
+	hotplugHead = (hotplugHead + 1) % HOTPLUG_QUEUE_LENGTH;
+	hotplugCount--;
+	hotplugDropped++;
+    }
+
+    newEvent = &hotplugQueue[(hotplugHead + hotplugCount) % HOTPLUG_QUEUE_LENGTH];
+    hotplugCount++;
+
+    newEvent->event = event;
+    newEvent->sequence = ++hotplugSequence;
+    newEvent->usbAddress = [device usbAddress];
+    newEvent->port = [device hardwareHubPort];
+    newEvent->class = [device usbClass];
+    newEvent->subClass = [device usbSubClass];
+    newEvent->vendorID = desc->vendorID;
+    newEvent->productID = desc->productID;
+    newEvent->releaseNum = desc->deviceReleaseNum;
+    newEvent->numEndpoints = [device numEndpoints];
+
+    driverName = [self matchDriverForDevice:device];
+    if(driverName != NULL) {
+	strncpy(newEvent->driverName, driverName, USB_DRIVER_NAME_LENGTH-1);
+	newEvent->driverName[USB_DRIVER_NAME_LENGTH-1] = '\0';
+    }
+    else
+	newEvent->driverName[0] = '\0';
+
+    [hotplugLock unlockWith:HOTPLUG_PENDING];
+
+    return;
+}
+
+
+/*
+ *  Take the oldest event off the queue.  With waitFlag set this
+ *  sleeps until there is one, otherwise it returns NO right away
+ *  if the queue is empty.
+ */
+- (BOOL)nextHotplugEvent:(usbHotplugEvent_t *)event wait:(BOOL)waitFlag
+{
+    if(waitFlag == YES)
+	[hotplugLock lockWhen:HOTPLUG_PENDING];
+    else {
+	[hotplugLock lock];
+	if(hotplugCount == 0) {
+	    [hotplugLock unlockWith:HOTPLUG_EMPTY];
+	    return NO;
+	}
+    }
+
+    *event = hotplugQueue[hotplugHead];
+    hotplugHead = (hotplugHead + 1) % HOTPLUG_QUEUE_LENGTH;
+    hotplugCount--;
+
+    [hotplugLock unlockWith:((hotplugCount > 0) ? HOTPLUG_PENDING : HOTPLUG_EMPTY)];
+
+    return YES;
+}
+
+
+/*
+ *  Add an entry to the driver match table, replacing any
+ *  entry which has exactly the same key.
+ */
+- (int)addDriverMatch:(usbDriverMatch_t *)match
+{
+    int imatch;
+
+    /* The table is also read by -postHotplugEvent:, under the same lock */
+    [hotplugLock lock];
+
+    for(imatch=0; imatch<numDriverMatches; imatch++) {
+	usbDriverMatch_t *entry = &driverMatchTable[imatch];
+	if((entry->class == match->class) && (entry->subClass == match->subClass) &&
+	   (entry->vendorID == match->vendorID) && (entry->productID == match->productID))
+	    break;
+    }
+
+    if(imatch >= MAX_DRIVER_MATCH) {
+	[hotplugLock unlockWith:[hotplugLock condition]];
+	IOLog("usb - driver match table is full\n");
+	return ENOSPC;
+    }
+
+    driverMatchTable[imatch] = *match;
+    driverMatchTable[imatch].driverName[USB_DRIVER_NAME_LENGTH-1] = '\0';
+    if(imatch == numDriverMatches) numDriverMatches++;
+
+    [hotplugLock unlockWith:[hotplugLock condition]];
+
+    return 0;
+}
+
+
+/*
+ *  Find the driver which best matches a device.  Vendor/product
+ *  matches beat class/subclass matches, which beat wildcards.
+ */
+- (char *)matchDriverForDevice:(USBDevice *)device
+{
+    int imatch, score, bestScore = -1;
+    usbDriverMatch_t *best = NULL;
+    deviceDescriptor_t *desc = [device deviceDescriptor];
+
+    for(imatch=0; imatch<numDriverMatches; imatch++) {
+	usbDriverMatch_t *entry = &driverMatchTable[imatch];
+
+	score = 0;
+
+	if(entry->vendorID != USB_MATCH_ANY) {
+	    if(entry->vendorID != desc->vendorID) continue;
+	    score += 8;
+	}
+	if(entry->productID != USB_MATCH_ANY) {
+	    if(entry->productID != desc->productID) continue;
+	    score += 4;
+	}
+	if(entry->class != USB_MATCH_ANY) {
+	    if(entry->class != [device usbClass]) continue;
+	    score += 2;
+	}
+	if(entry->subClass != USB_MATCH_ANY) {
+	    if(entry->subClass != [device usbSubClass]) continue;
+	    score += 1;
+	}
+
+	if(score > bestScore) {
+	    bestScore = score;
+	    best = entry;
+	}
+    }
+
+    if(best == NULL) return NULL;
+    return best->driverName;
+}
+
+
 /*
  *  NOTE:  The data field of the deviceRequest inside the
  *         transfer request --MUST-- --MUST-- be wired
@@ -1433,8 +1901,7 @@ static instPort;
     int numFullTDs=0, numDataTDs=0, numExtras=0;
     unsigned char *dataPtr;
     unsigned int physDataPtr;
-    int ioerr;
-    unsigned int status;
+    int ioerr,doneDelay;
 
     /*
      *  You need to create these transfer descriptors:
@@ -1459,6 +1926,7 @@ static instPort;
 
     packetDir = [transRequest dataDir];
     maxPacketSize = [endpoint maxPacketSize];
+    doneDelay = ([endpoint pollLimit] > 0) ? POLL_DONE_DELAY : DONE_DELAY;
 
     /* Get tail transfer object for this endpoint      */
     /* This descriptor will become the setup phase TD  */
@@ -1475,17 +1943,9 @@ static instPort;
      *  
      */
 
-    /* 1)  SETUP TD flags */
-    setupTD->dword0.field.undef1 = 0;
-    setupTD->dword0.field.bufferRounding = 1;
-    setupTD->dword0.field.directionPID = DIR_SETUP;
-    setupTD->dword0.field.delayInterrupt = NO_INTERRUPT;
-    setupTD->dword0.field.dataToggle = TOGGLE_0;
-    setupTD->dword0.field.errorCount = 0;
-    setupTD->dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
-
-    /* Allocate and connect a data buffer with 8 bytes */
+    /* 1)  Allocate and connect a data buffer with 8 bytes, then the SETUP TD flags */
     [setupTransfer allocDataPacket:STANDARD_REQ_LENGTH];
+    setupTD->dword0.word = td_flags(DIR_SETUP, NO_INTERRUPT, TOGGLE_0, 1);
 
     /* Get a handle on the data, fill with standard request */
     setupData = [setupTransfer dataPacket];
@@ -1522,22 +1982,15 @@ static instPort;
 	    dataTransfer = [[USBTransfer alloc] init];
 	    dataTD = [dataTransfer descriptor];
 
-	    dataTD->dword0.field.undef1 = 0;
-	    dataTD->dword0.field.bufferRounding = 1;                /* Rounding not OK         */
-	    dataTD->dword0.field.directionPID = packetDir;          /* Direction of data packs */
-	    dataTD->dword0.field.delayInterrupt = NO_INTERRUPT;
-	    dataTD->dword0.field.dataToggle = TOGGLE_AUTO;
-	    dataTD->dword0.field.errorCount = 0;
-	    dataTD->dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
-
 	    ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), (vm_address_t)dataPtr, &physDataPtr);
 	    if(ioerr) {
 		IOLog("usb - Kernel can't locate physical location of data buffer\n");
 		return EIO;
 	    }
 	    
-	    dataTD->dword1.field.currentPointer = physDataPtr;
-	    dataTD->dword3.field.bufferEnd = physDataPtr+maxPacketSize-1;
+	    td_fill(dataTD, td_flags(packetDir, NO_INTERRUPT, TOGGLE_AUTO, 1),
+		    physDataPtr, physDataPtr+maxPacketSize-1);
+	    [dataTransfer setBuffer:physDataPtr length:maxPacketSize];
 	
 	    dataPtr += maxPacketSize;
 
@@ -1551,22 +2004,15 @@ static instPort;
 	    dataTransfer = [[USBTransfer alloc] init];
 	    dataTD = [dataTransfer descriptor];
 
-	    dataTD->dword0.field.undef1 = 0;
-	    dataTD->dword0.field.bufferRounding = 1;             /* Rounding OK   */
-	    dataTD->dword0.field.directionPID = packetDir;       /* Input data    */
-	    dataTD->dword0.field.delayInterrupt = NO_INTERRUPT;
-	    dataTD->dword0.field.dataToggle = TOGGLE_AUTO;
-	    dataTD->dword0.field.errorCount = 0;
-	    dataTD->dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
-
 	    ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), (vm_address_t)dataPtr, &physDataPtr);
 	    if(ioerr) {
 		IOLog("usb - Kernel can't locate physical location of data buffer\n");
 		return EIO;
 	    }
 	    
-	    dataTD->dword1.field.currentPointer = physDataPtr;
-	    dataTD->dword3.field.bufferEnd = physDataPtr+numExtras-1;
+	    td_fill(dataTD, td_flags(packetDir, NO_INTERRUPT, TOGGLE_AUTO, 1),
+		    physDataPtr, physDataPtr+numExtras-1);
+	    [dataTransfer setBuffer:physDataPtr length:numExtras];
 	
 	    dataPtr += numExtras;
 
@@ -1582,17 +2028,11 @@ static instPort;
     statusTransfer = [[USBTransfer alloc] init];
     statusTD = [statusTransfer descriptor];
     
-    /* Setup transfer descriptor flags */
-    statusTD->dword0.field.undef1 = 0;
-    statusTD->dword0.field.bufferRounding = 1;               /* Rounding OK      */
-    statusTD->dword0.field.directionPID = 
-	    (packetDir==DIR_OUT) ? DIR_IN : DIR_OUT;         /* Data OUT - ACK from Device, pg 107 USB Book  */
-    statusTD->dword0.field.delayInterrupt = 6;
-    statusTD->dword0.field.dataToggle = TOGGLE_1;            /* Status is always TOGGLE_1  */
-    statusTD->dword0.field.errorCount = 0;
-    statusTD->dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
-    statusTD->dword1.field.currentPointer = 0;
-    statusTD->dword3.field.bufferEnd = 0;
+    /*
+     *  Data OUT - ACK from Device, pg 107 USB Book.
+     *  Status is always TOGGLE_1, and carries no data.
+     */
+    td_fill(statusTD, td_flags((packetDir==DIR_OUT) ? DIR_IN : DIR_OUT, doneDelay, TOGGLE_1, 1), 0, 0);
 
     /* Queue the status packet */
     [endpoint queueTransfer:statusTransfer];
@@ -1610,9 +2050,7 @@ static instPort;
     [endpoint updateTailPointer];
 
     /* Let Controller know we've queued something (Control List Filled)  */
-    status = *((unsigned int *)(HcBase+HcCommandStatus));
-    status |= (HC_CLF | HC_BLF);
-    *((unsigned int *)(HcBase+HcCommandStatus)) = status;
+    ohci_command(&hcRegs, HC_CLF | HC_BLF);
 
     /*
      *  Everything is queued.  Let the hardware do its thing
@@ -1643,9 +2081,9 @@ static instPort;
     USBTransfer *tailTransfer;
     volatile td_t *dataTD = NULL;
     unsigned char *dataPtr;
-    unsigned int physDataPtr;
+    unsigned int physDataPtr,physDmaData;
     int idata,ioerr;
-    unsigned int status;
+    int last,toggle,doneDelay;
 
     /*
      *  Note:  All Hardware-level TDs which are created here will be
@@ -1662,6 +2100,13 @@ static instPort;
     endpoint = [transRequest endpoint];
     reqData = [transRequest data];
 
+    /* A bounce buffer is already wired and translated */
+    if([transRequest dmaData] != NULL) reqData = [transRequest dmaData];
+    physDmaData = [transRequest physDmaData];
+
+    /* A caller polling for this one wants the done head right away */
+    doneDelay = ([endpoint pollLimit] > 0) ? POLL_DONE_DELAY : DONE_DELAY;
+
     /* Extract Data direction from Request command */
     packetDir = [transRequest dataDir];
     maxPacketSize = [endpoint maxPacketSize];
@@ -1680,28 +2125,36 @@ static instPort;
 	    dataTransfer = [[USBTransfer alloc] init];
 
 	dataTD = [dataTransfer descriptor];
+	last = ((numExtras == 0) && (idata == numFullTDs-1));
 
-	dataTD->dword0.field.undef1 = 0;
-	dataTD->dword0.field.bufferRounding = 1;
-	dataTD->dword0.field.directionPID = packetDir;
-	dataTD->dword0.field.delayInterrupt = (idata==0 ? 6 : NO_INTERRUPT);
 	if((idata==0) && ([endpoint forceToggle]==YES)) {
-	    dataTD->dword0.field.dataToggle = TOGGLE_0;
+	    toggle = TOGGLE_0;
 	    [endpoint forceToggle:NO];
 	}
 	else
-	  dataTD->dword0.field.dataToggle = TOGGLE_AUTO;
-	dataTD->dword0.field.errorCount = 0;
-	dataTD->dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
-
-	ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), (vm_address_t)dataPtr, &physDataPtr);
-	if(ioerr) {
-	  IOLog("usb - Kernel can't locate physical location of data buffer\n");
-	  return EIO;
+	    toggle = TOGGLE_AUTO;
+
+	if(physDmaData != 0)
+	    physDataPtr = physDmaData + (dataPtr - reqData);
+	else {
+	    ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), (vm_address_t)dataPtr, &physDataPtr);
+	    if(ioerr) {
+		IOLog("usb - Kernel can't locate physical location of data buffer\n");
+		return EIO;
+	    }
 	}
 	    
-	dataTD->dword1.field.currentPointer = physDataPtr;
-	dataTD->dword3.field.bufferEnd = physDataPtr+maxPacketSize-1;
+	/*
+	 *  Rounding is turned off on IN packets so a short packet
+	 *  halts the ED with DATA UNDERRUN and gets reported right
+	 *  away.  The last TD interrupts, and may legitimately come
+	 *  back short.
+	 */
+	td_fill(dataTD,
+		td_flags(packetDir, (idata==0 || last) ? doneDelay : NO_INTERRUPT, toggle,
+			 (packetDir != DIR_IN) || last),
+		physDataPtr, physDataPtr+maxPacketSize-1);
+	[dataTransfer setBuffer:physDataPtr length:maxPacketSize];
 	
 	dataPtr += maxPacketSize;
 
@@ -1722,22 +2175,27 @@ static instPort;
 
 	dataTD = [dataTransfer descriptor];
 
-	dataTD->dword0.field.undef1 = 0;
-	dataTD->dword0.field.bufferRounding = 1;
-	dataTD->dword0.field.directionPID = packetDir;
-	dataTD->dword0.field.delayInterrupt = NO_INTERRUPT;
-	dataTD->dword0.field.dataToggle = TOGGLE_AUTO;
-	dataTD->dword0.field.errorCount = 0;
-	dataTD->dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
-
-	ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), (vm_address_t)dataPtr, &physDataPtr);
-	if(ioerr) {
-	  IOLog("usb - Kernel can't locate physical location of data buffer\n");
-	  return EIO;
+	if((idata==0) && ([endpoint forceToggle]==YES)) {
+	    toggle = TOGGLE_0;
+	    [endpoint forceToggle:NO];
+	}
+	else
+	    toggle = TOGGLE_AUTO;
+
+	if(physDmaData != 0)
+	    physDataPtr = physDmaData + (dataPtr - reqData);
+	else {
+	    ioerr = IOPhysicalFromVirtual(IOVmTaskSelf(), (vm_address_t)dataPtr, &physDataPtr);
+	    if(ioerr) {
+		IOLog("usb - Kernel can't locate physical location of data buffer\n");
+		return EIO;
+	    }
 	}
 	    
-	dataTD->dword1.field.currentPointer = physDataPtr;
-	dataTD->dword3.field.bufferEnd = physDataPtr+numExtras-1;
+	/* Always the last TD */
+	td_fill(dataTD, td_flags(packetDir, doneDelay, toggle, 1),
+		physDataPtr, physDataPtr+numExtras-1);
+	[dataTransfer setBuffer:physDataPtr length:numExtras];
 	
 	dataPtr += numExtras;
 
@@ -1748,8 +2206,6 @@ static instPort;
 	[transRequest addTransfer:dataTransfer];
     }
 
-    dataTD->dword0.field.delayInterrupt = 6;
-
     /* Setup a new empty Tail TD  */
     tailTransfer = [[USBTransfer alloc] init];
     [endpoint queueTransfer:tailTransfer];
@@ -1758,9 +2214,7 @@ static instPort;
     [endpoint updateTailPointer];
 
     /* Let Controller know we've queued something (Control List Filled)  */
-    status = *((unsigned int *)(HcBase+HcCommandStatus));
-    status |= (HC_CLF | HC_BLF);
-    *((unsigned int *)(HcBase+HcCommandStatus)) = status;
+    ohci_command(&hcRegs, HC_CLF | HC_BLF);
 
     /*
      *  Everything is queued.  Let the hardware do its thing
@@ -1790,13 +2244,13 @@ static instPort;
 
     newED = [newEndpoint descriptor];
     newPhysED = [newEndpoint physicalAddress];
-    newED->dword0.field.skip = 0;
-    newED->dword3.field.nextED = 0;
+    newED->dword0.word &= ~ED_K;
+    newED->dword3.word = 0;
 
-    /* Get last ED in List */
+    /* Get last ED in List, and link the new ED in with one store */
     tailEndpoint = [edList lastObject];
     tailED = [tailEndpoint descriptor];
-    tailED->dword3.field.nextED = (newPhysED >> 4);
+    tailED->dword3.word = newPhysED & 0xFFFFFFF0;
 
     /* Update kernel pointers */
     [tailEndpoint nextEndpoint:newEndpoint];
@@ -1810,47 +2264,227 @@ static instPort;
 }
 
 
-- (void)removeEndpoint:(USBEndpoint *)thisEndpoint
+/*
+ *  Take an endpoint out of the schedule so it can be freed.  This
+ *  follows section 5.2.7.1.2 of the OHCI Spec.  The ED is skipped
+ *  and the frame allowed to finish, then it's unlinked.  Its own
+ *  nextED is left alone, so a controller sitting on it carries on
+ *  down the list.  Control and bulk lists are processed across
+ *  frames, so the list is stopped while HcControlCurrentED or
+ *  HcBulkCurrentED is moved off the ED.  One more frame later the
+ *  controller can't be holding a pointer to it.  Endpoints which
+ *  were never linked in are left alone.  This sleeps, so it's
+ *  not for the I/O thread.
+ */
+- (void)removeEndpoint:(USBEndpoint *)thisEndpoint
 {
     USBEndpoint *prevEndpoint = [thisEndpoint prevEndpoint];
     USBEndpoint *nextEndpoint = [thisEndpoint nextEndpoint];
+    unsigned int physED = [thisEndpoint physicalAddress] & 0xFFFFFFF0;
+    unsigned int physNext = (nextEndpoint != nil) ? ([nextEndpoint physicalAddress] & 0xFFFFFFF0) : 0;
+    unsigned int enableFlags = 0, filledFlags = 0, currentEDRegister = 0;
 
-    if(prevEndpoint == nil) {
-        IOLog("usb - No ED Placeholder in Hardware B!\n");
-	return;
-    }
+    if(prevEndpoint == nil) return;
 
-#if 0
-    [self pauseEndpoint:thisEndpoint];
-#else
-    {
-        [thisEndpoint descriptor]->dword0.field.skip = 1;
-	IOSleep(2);
+    [thisEndpoint descriptor]->dword0.word |= ED_K;
+    [self waitFrames:1];
+
+    if([thisEndpoint type] == BULK_TYPE) {
+	enableFlags = HC_BLE;
+	filledFlags = HC_BLF;
+	currentEDRegister = HcBulkCurrentED;
+
+	/* Bulk ordering changes under bulkLock, see -bulkEndpointServed: */
+	[bulkLock lock];
+	[self unlinkBulkEndpoint:thisEndpoint];
+	[bulkLock unlock];
     }
-#endif
+    else {
+	if([thisEndpoint type] == CONTROL_TYPE) {
+	    enableFlags = HC_CLE;
+	    filledFlags = HC_CLF;
+	    currentEDRegister = HcControlCurrentED;
+	    [controlEDList removeObject:thisEndpoint];
+	}
 
-    if(nextEndpoint != nil) {
-        /* Update physical pointer */
-        [prevEndpoint descriptor]->dword3.field.nextED = 
-	    ([nextEndpoint physicalAddress] >> 4);
+	/* One store takes it out of the hardware list */
+	[prevEndpoint descriptor]->dword3.word = physNext;
 
 	/* Update kernel pointers */
 	[prevEndpoint nextEndpoint:nextEndpoint];
-	[nextEndpoint prevEndpoint:prevEndpoint];
+	if(nextEndpoint != nil) [nextEndpoint prevEndpoint:prevEndpoint];
     }
-    else {
-        /* Update physical pointer */
-        [prevEndpoint descriptor]->dword3.field.nextED = 0;
 
-	/* Update kernel pointers */
-	[prevEndpoint nextEndpoint:nil];
+    if(enableFlags != 0) {
+	ohci_control_clear(&hcRegs, enableFlags);
+	[self waitFrames:1];
+
+	if((ohci_read(&hcRegs, currentEDRegister) & 0xFFFFFFF0) == physED)
+	    ohci_write(&hcRegs, currentEDRegister, physNext);
+
+	ohci_control_set(&hcRegs, enableFlags);
+
+	/* Somebody else may have had work queued while the list was off */
+	ohci_command(&hcRegs, filledFlags);
     }
 
-    [thisEndpoint descriptor]->dword0.field.skip = 0;
+    [thisEndpoint prevEndpoint:nil];
+    [thisEndpoint nextEndpoint:nil];
+
+    /* Let the controller finish with anything it read before now */
+    [self waitFrames:1];
+
+    return;
+}
+
+
+/*
+ *  Sleep until nframes frames have started.  Gives up after twice
+ *  as long, in case the controller isn't running.
+ */
+- (void)waitFrames:(int)nframes
+{
+    usbFrame_t target = [self currentFrame] + nframes;
+    int i;
+
+    for(i=0; i<2*nframes+1; i++) {
+	if([self currentFrame] >= target) break;
+	IOSleep(1);
+    }
+
+    return;
+}
+
+
+/* Lowest free USB address, or 0 if all 127 are taken */
+- (int)allocAddress
+{
+    int usbAddress;
+
+    for(usbAddress=1; usbAddress<=USB_MAX_ADDRESS; usbAddress++) {
+	if((addressMap[usbAddress/32] & (1 << (usbAddress%32))) == 0) {
+	    addressMap[usbAddress/32] |= (1 << (usbAddress%32));
+	    return usbAddress;
+	}
+    }
+
+    return 0;
+}
+
+
+- (void)releaseAddress:(int)usbAddress
+{
+    if((usbAddress < 1) || (usbAddress > USB_MAX_ADDRESS)) return;
+
+    addressMap[usbAddress/32] &= ~(1 << (usbAddress%32));
+    return;
+}
+
+
+/*
+ *  Finish any requests still on the hardware for a device that's
+ *  going away, with CC_REMOVED.  The device's endpoints are already
+ *  skipped.  Requests which haven't started yet have no TDs and are
+ *  finished along with the phase before them.
+ */
+- (void)retireRequestsForDevice:(USBDevice *)device
+{
+    TransferRequest *transRequest;
+    USBEndpoint *ep;
+    int itr;
+    static void usbTimeOut(void *);
+
+    [processedLock lock];
+
+    for(itr=0; itr<[usbProcessedList count]; itr++) {
+	transRequest = [usbProcessedList objectAt:itr];
+	if([transRequest device] != device) continue;
+	if([transRequest numTDsQueued] == 0) continue;
+
+	if([transRequest expireTime] > 0)
+	    IOUnscheduleFunc(usbTimeOut, transRequest);
+
+	ep = [transRequest endpoint];
+	while([transRequest numTDsQueued] > 0) {
+	    USBTransfer *td = [transRequest transferAt:0];
+	    [transRequest removeTransferAt:0];
+	    [ep unLinkTransfer:td];
+	}
+
+	[transRequest completionCode:CC_REMOVED];
+	[self completeRequest:transRequest];
+    }
+
+    [processedLock unlock];
+
+    return;
+}
+
+
+/*
+ *  Tear a device down and free it, along with its endpoints, TDs
+ *  and USB address.  Its endpoints are skipped first, and the
+ *  controller given long enough to hand back on the done queue
+ *  anything it has already retired.  That is purged before the
+ *  rest is taken off the hardware.  This sleeps for a few frames, so it's only
+ *  called from the install thread.
+ */
+- (void)removeDevice:(USBDevice *)device
+{
+    int iep;
+
+    /*  No new requests, and the I/O thread won't start queued ones.
+     *  Nobody else finds it, or its endpoints as they're freed.
+     */
+    [deviceLock lock];
+    [device hardwareIsUp:NO];
+    [usbDeviceList removeObject:device];
+    [deviceLock unlock];
+    [device idleEndpoints];
+
+    [self waitFrames:DONE_QUEUE_FRAMES];
+
+    /*  Retire what the controller has handed back but the I/O thread
+     *  hasn't got to yet.  A TD freed while it's still on the done
+     *  queue would break the next purge.
+     */
+    [self purgeDoneQueue];
+
+    [self closeStreamsForDevice:device];
+    [self closeRingsForDevice:device];
+    [self retireRequestsForDevice:device];
+
+    for(iep=0; iep<=[device numEndpoints]; iep++)
+	[self removeEndpoint:[device endpointAtIndex:iep]];
+
+    [self releaseAddress:[device usbAddress]];
+    [device free];
+
+    return;
+}
+
+
+/*
+ *  Free the devices -idleDeviceOnPort: put aside.  Install thread.
+ */
+- (void)reapDevices
+{
+    USBDevice *device;
+
+    [removeLock lock];
+    while([removeList count] > 0) {
+	device = [removeList removeObjectAt:0];
+	[removeLock unlock];
+
+	IOLog("usb - removing device at address %d\n",[device usbAddress]);
+	[self removeDevice:device];
+
+	[removeLock lock];
+    }
+    [removeLock unlock];
 
     return;
 }
-    
 
 
 
@@ -1887,9 +2521,13 @@ static instPort;
 	return;
     }
 
-    /* Ah, we found one.  Update the physical pointers */
-    [currentEndpoint descriptor]->dword3.field.nextED = ([newED physicalAddress] >> 4);
-    [newED descriptor]->dword3.field.nextED = ([[currentEndpoint nextEndpoint] physicalAddress] >> 4);
+    /*
+     *  Ah, we found one.  Update the physical pointers.  The new ED
+     *  has to point onward before anything points at it, or the
+     *  controller could walk off the end of the list.
+     */
+    [newED descriptor]->dword3.word = [[currentEndpoint nextEndpoint] physicalAddress] & 0xFFFFFFF0;
+    [currentEndpoint descriptor]->dword3.word = [newED physicalAddress] & 0xFFFFFFF0;
 
     /* Update the kernel pointers */
     [newED nextEndpoint:[currentEndpoint nextEndpoint]];
@@ -1907,6 +2545,213 @@ static instPort;
 
 
 
+/*
+ *  Bulk endpoints are kept in bulkEDList, and in the hardware
+ *  list, in priority order behind the placeholder ED.  A new one
+ *  goes at the back of its priority class.
+ */
+- (void)insertBulkEndpoint:(USBEndpoint *)newEndpoint
+{
+    [bulkLock lock];
+    [self linkBulkEndpoint:newEndpoint];
+    [bulkLock unlock];
+
+    [newEndpoint descriptor]->dword0.word &= ~ED_K;
+
+    return;
+}
+
+
+/*
+ *  Link an endpoint in at the back of its priority class.  The
+ *  endpoint is made to point onward before anything points at it,
+ *  so the controller never sees a broken list.  bulkLock is held.
+ */
+- (void)linkBulkEndpoint:(USBEndpoint *)endpoint
+{
+    USBEndpoint *prev,*next;
+    int i;
+
+    for(i=[bulkEDList count]-1; i>0; i--) {
+	if([(USBEndpoint *)[bulkEDList objectAt:i] bulkPriority] <= [endpoint bulkPriority])
+	    break;
+    }
+
+    prev = [bulkEDList objectAt:i];
+    next = [prev nextEndpoint];
+
+    [endpoint descriptor]->dword3.word = (next != nil) ? ([next physicalAddress] & 0xFFFFFFF0) : 0;
+    [prev descriptor]->dword3.word = [endpoint physicalAddress] & 0xFFFFFFF0;
+
+    [endpoint prevEndpoint:prev];
+    [endpoint nextEndpoint:next];
+    [prev nextEndpoint:endpoint];
+    if(next != nil) [next prevEndpoint:endpoint];
+
+    [bulkEDList insertObject:endpoint at:i+1];
+
+    return;
+}
+
+
+/*
+ *  Take an endpoint out of the bulk list.  Its own nextED is left
+ *  alone, so if the controller is sitting on it right now it
+ *  carries on down the list.  The endpoint mustn't be linked back
+ *  in until the controller has moved off it, see
+ *  -requeueBulkEndpoint:.  A parked endpoint is out of the list
+ *  already, and just stops waiting.  bulkLock is held.
+ */
+- (void)unlinkBulkEndpoint:(USBEndpoint *)endpoint
+{
+    USBEndpoint *prev = [endpoint prevEndpoint];
+    USBEndpoint *next = [endpoint nextEndpoint];
+
+    if([endpoint bulkParked]) {
+	[bulkParkedList removeObject:endpoint];
+	[endpoint bulkParked:NO];
+	return;
+    }
+
+    [prev descriptor]->dword3.word = (next != nil) ? ([next physicalAddress] & 0xFFFFFFF0) : 0;
+
+    [prev nextEndpoint:next];
+    if(next != nil) [next prevEndpoint:prev];
+
+    [bulkEDList removeObject:endpoint];
+
+    return;
+}
+
+
+/*
+ *  Move an endpoint to the back of its priority class.  Linking it
+ *  in again rewrites its own nextED, which would cut the list short
+ *  if the controller were on it, so it's taken out now and parked
+ *  until a frame has gone by with HcBulkCurrentED somewhere else.
+ *  Its TDs wait a frame or two.  bulkLock is held.
+ */
+- (void)requeueBulkEndpoint:(USBEndpoint *)endpoint
+{
+    static void bulkRelink(void *, usbFrame_t);
+
+    [self unlinkBulkEndpoint:endpoint];
+    [bulkParkedList addObject:endpoint];
+    [endpoint bulkParked:YES];
+
+    if((bulkRelinkPending == NO) &&
+       ([self runAtFrame:[self currentFrame] + 2 func:bulkRelink arg:self] == 0))
+	bulkRelinkPending = YES;
+
+    return;
+}
+
+
+/*
+ *  Frame callout, in the I/O thread.  Link parked endpoints back in
+ *  unless the controller is still sitting on one.  The controller
+ *  can only reach a parked endpoint through HcBulkCurrentED, so
+ *  once that has moved on it's safe.
+ */
+- (void)relinkParkedEndpoints:(usbFrame_t)frame
+{
+    static void bulkRelink(void *, usbFrame_t);
+    USBEndpoint *endpoint;
+    unsigned int physCurrent;
+    BOOL relinked = NO;
+    int i;
+
+    [bulkLock lock];
+
+    bulkRelinkPending = NO;
+    physCurrent = ohci_read(&hcRegs, HcBulkCurrentED) & 0xFFFFFFF0;
+
+    for(i=0; i<[bulkParkedList count]; ) {
+	endpoint = [bulkParkedList objectAt:i];
+	if(([endpoint physicalAddress] & 0xFFFFFFF0) == physCurrent) {
+	    i++;
+	    continue;
+	}
+
+	[bulkParkedList removeObjectAt:i];
+	[endpoint bulkParked:NO];
+	[self linkBulkEndpoint:endpoint];
+	relinked = YES;
+    }
+
+    if(([bulkParkedList count] > 0) &&
+       ([self runAtFrame:frame + 1 func:bulkRelink arg:self] == 0))
+	bulkRelinkPending = YES;
+
+    [bulkLock unlock];
+
+    /* Their TDs may have been skipped over meanwhile */
+    if(relinked) ohci_command(&hcRegs, HC_BLF);
+
+    return;
+}
+
+
+/*
+ *  Called from -purgeDoneQueue each time a bulk request completes.
+ *  The controller moves one packet per ED each time it passes down
+ *  the bulk list, so whoever is first in the list gets the first
+ *  packet of every pass.  Once an endpoint has completed its weight
+ *  in requests, it goes to the back of its priority class, as long
+ *  as somebody else in the class has something queued.  Every
+ *  endpoint keeps its blank tail TD, so more than one TD queued
+ *  means work to do.
+ */
+- (void)bulkEndpointServed:(USBEndpoint *)endpoint
+{
+    USBEndpoint *other;
+    BOOL waiting = NO;
+    int i,n,last = -1;
+
+    if([endpoint bulkTurnUsed] == NO) return;
+
+    [bulkLock lock];
+
+    n = [bulkEDList count];
+    for(i=1; i<n; i++) {
+	other = [bulkEDList objectAt:i];
+	if([other bulkPriority] != [endpoint bulkPriority]) continue;
+	last = i;
+	if((other != endpoint) && ([other numTDsQueued] > 1)) waiting = YES;
+    }
+
+    if(waiting && ([bulkEDList objectAt:last] != endpoint) && ([endpoint bulkParked] == NO)) {
+	[self requeueBulkEndpoint:endpoint];
+	[endpoint bulkRotated];
+    }
+
+    [bulkLock unlock];
+
+    return;
+}
+
+
+- (USBDevice *)deviceAtAddress:(int)usbAddress
+{
+    USBDevice *device = nil;
+    int idev,ndevs;
+
+    [deviceLock lock];
+    ndevs = [usbDeviceList count];
+    for(idev=0; idev<ndevs; idev++) {
+	USBDevice *currentDevice = [usbDeviceList objectAt:idev];
+	if([currentDevice usbAddress] == usbAddress) {
+	    device = currentDevice;
+	    break;
+	}
+    }
+    [deviceLock unlock];
+
+    return device;
+}
+
+
+
 
 
 
@@ -1920,23 +2765,29 @@ static instPort;
 
 - (BOOL)hardwareIsUp:(int)usbAddress
 {
+    BOOL isUp = NO;
     int idev,ndevs;
 
+    [deviceLock lock];
     ndevs = [usbDeviceList count];
     for(idev=0; idev<ndevs; idev++) {
 	int localAddr = [[usbDeviceList objectAt:idev] usbAddress];
-	if(localAddr == usbAddress)
-	  return [[usbDeviceList objectAt:idev] hardwareIsUp];
+	if(localAddr == usbAddress) {
+	  isUp = [[usbDeviceList objectAt:idev] hardwareIsUp];
+	  break;
+	}
     }
+    [deviceLock unlock];
 
-    return NO;
+    return isUp;
 }
 
 
 - (int)connect:(id)sender toDeviceClass:(int)usbClass subClass:(int)usbSubClass
 {
-    int idev,ndevs;
+    int idev,ndevs,usbAddress = 0;
 
+    [deviceLock lock];
     ndevs = [usbDeviceList count];
     for(idev=0; idev<ndevs; idev++) {
 	USBDevice *localDev = [usbDeviceList objectAt:idev];
@@ -1948,11 +2799,13 @@ static instPort;
 	if( ([localDev hasDeviceDriver] == NO) &&
 	    ([localDev hardwareIsUp] == YES) ) {
 	        [localDev deviceDriver:sender];
-	        return [localDev usbAddress];
+	        usbAddress = [localDev usbAddress];
+	        break;
 	}
     }
+    [deviceLock unlock];
 
-    return 0;
+    return usbAddress;
 }
 	    
 
@@ -1968,22 +2821,18 @@ static instPort;
 		  timeOut:(int)hardTimeOut
                      from:(id)sender
 {
-    int idev,ndevs,dataDir;
+    int dataDir;
     USBDevice *device = nil;
     msg_return_t r;
     USBEndpoint *ep;
     TransferRequest *transRequest;
+    ns_time_t startTime;
     static void usbTimeOut(void *);
 
+    IOGetTimestamp(&startTime);
+
     /* Get the USBDevice corresponding to this usb address */
-    ndevs = [usbDeviceList count];
-    for(idev=0; idev<ndevs; idev++) {
-	USBDevice *currentDevice = [usbDeviceList objectAt:idev];
-	if([currentDevice usbAddress] == usbAddress) {
-	    device = currentDevice;
-	    break;
-	}
-    }
+    device = [self deviceAtAddress:usbAddress];
 
     /* Does the device exist */
     if(device == nil) return ENXIO;
@@ -1999,7 +2848,7 @@ static instPort;
     else dataDir = DIR_IN;
 
     /* Set up a TransferRequest for this transaction */
-    transRequest = [[TransferRequest alloc] init];
+    transRequest = [self allocTransferRequest];
     [transRequest completionCode:HC_CC_NO_ERROR];
     [transRequest device:device];
     [transRequest timeOutPort:msgPort];
@@ -2007,6 +2856,7 @@ static instPort;
     ep = [device endpointForNumber:endpointNum direction:dataDir];
     if(ep == nil) {
 	IOLog("UsbOHCI from doRequest:  Can't determine endpoint\n");
+	[self recycleTransferRequest:transRequest];
 	return -1;
     }
     [transRequest endpoint:ep];
@@ -2032,7 +2882,7 @@ static instPort;
     [transRequest data:reqData];
     [transRequest dataLength:devReq->wLength];
     [transRequest dataDir:dataDir];
-    [[transRequest transferLock] unlockWith:TRANSFER_INPROGRESS];
+    [transRequest transferState:TRANSFER_INPROGRESS];
 
     /* Queue the Transfer Request */
     [commandLock lock];
@@ -2074,14 +2924,16 @@ static instPort;
     }
 
     /* Wait till the request is filled */
-    [[transRequest transferLock] lockWhen:TRANSFER_DONE];
+    [self waitForRequest:transRequest];
+
+    [self captureRequest:transRequest address:usbAddress endpoint:endpointNum start:startTime];
 
     /* Dequeue transfer request */
     [processedLock lock];
     [usbProcessedList removeObject:transRequest];
     [processedLock unlock];
 
-    [transRequest free];
+    [self recycleTransferRequest:transRequest];
 
     return 0;
 
@@ -2101,22 +2953,41 @@ static instPort;
 	     timeOut:(int)hardTimeOut
 		from:(id)sender
 {
-    int idev,ndevs;
-    USBDevice *device = nil;
-    msg_return_t r;
-    USBEndpoint *ep;
+    return [self doIOonAddress:usbAddress
+		      endpoint:endpointNum
+		     direction:dataDir
+			  data:reqData
+			 ndata:numdata
+			actual:NULL
+		       timeOut:hardTimeOut
+			  from:sender];
+}
+
+
+/*
+ *  Same as above, but the number of bytes actually transferred
+ *  is returned in nactual.  An IN request completes as soon as
+ *  the device sends a short packet, so nactual may be less than
+ *  numdata.
+ */
+- (int)doIOonAddress:(int)usbAddress 
+	    endpoint:(int)endpointNum  
+	   direction:(int)dataDir 
+                data:(unsigned char *)reqData 
+               ndata:(int)numdata 
+	      actual:(int *)nactual
+	     timeOut:(int)hardTimeOut
+		from:(id)sender
+{
+    USBDevice *device;
     TransferRequest *transRequest;
-    static void usbTimeOut(void *);
+    ns_time_t startTime;
+    int ioerr;
+
+    IOGetTimestamp(&startTime);
 
     /* Get the USBDevice corresponding to this usb address */
-    ndevs = [usbDeviceList count];
-    for(idev=0; idev<ndevs; idev++) {
-	USBDevice *currentDevice = [usbDeviceList objectAt:idev];
-	if([currentDevice usbAddress] == usbAddress) {
-	    device = currentDevice;
-	    break;
-	}
-    }
+    device = [self deviceAtAddress:usbAddress];
 
     /* Does the device exist */
     if(device == nil) return ENXIO;
@@ -2127,26 +2998,140 @@ static instPort;
     /* insure the hardware is up */
     if([device hardwareIsUp] == NO) return EIO;
 
-    if(dataDir == 0) dataDir = DIR_OUT;
-    else dataDir = DIR_IN;
-    
     /* Set up a TransferRequest for this transaction */
-    transRequest = [[TransferRequest alloc] init];
-    [transRequest completionCode:HC_CC_NO_ERROR];
-    [transRequest device:device];
-
-    ep = [device endpointForNumber:endpointNum direction:dataDir];
-    if(ep == nil) {
+    transRequest = [self allocTransferRequest];
+    if([self prepareIO:transRequest device:device endpoint:endpointNum
+	     direction:dataDir data:reqData ndata:numdata] != 0) {
 	IOLog("UsbOHCI from doRequest:  Can't determine endpoint\n");
+	[self recycleTransferRequest:transRequest];
 	return -1;
     }
-    [transRequest endpoint:ep];
-    
-    /*
-     *  Make sure we haven't exceeded the maximum Endpoint
-     *  Queue length.  We can spin here till the cows come
-     *  home, and other threads still have access to the driver
-     *  because we haven't acquired the commandLock yet.
+
+    ioerr = [self submitRequest:transRequest timeOut:hardTimeOut];
+    if(ioerr != 0) return ioerr;
+
+    /* Wait till the request is filled, or until timed out */
+    [self waitForRequest:transRequest];
+
+    if(nactual != NULL) *nactual = [transRequest actualLength];
+
+    [self captureRequest:transRequest address:usbAddress endpoint:endpointNum start:startTime];
+
+    [self finishRequest:transRequest];
+
+    return 0;
+
+}
+
+
+/*
+ *  Run the phases of a transaction, command/data/status for
+ *  instance, as one request.  All of them are queued here, but
+ *  each phase only goes to the hardware once the one before it
+ *  completes, and that happens in the I/O thread without coming
+ *  back through here.  The first phase to fail ends the
+ *  transaction.  Each phase gets its actual length and completion
+ *  code back; phases which never ran come back HC_CC_NOT_ACCESSED.
+ *  Returns 0 if every phase completed without error.
+ */
+- (int)doTransactionOnAddress:(int)usbAddress
+		       phases:(usbPhase_t *)phases
+			count:(int)nphases
+		      timeOut:(int)hardTimeOut
+			 from:(id)sender
+{
+    USBDevice *device;
+    TransferRequest *requests[USB_MAX_PHASES];
+    ns_time_t startTime;
+    int i,ioerr,result;
+
+    IOGetTimestamp(&startTime);
+
+    if((nphases < 1) || (nphases > USB_MAX_PHASES)) return EINVAL;
+
+    device = [self deviceAtAddress:usbAddress];
+    if(device == nil) return ENXIO;
+    if((sender != self) && (sender != [device driver])) return EACCES;
+    if([device hardwareIsUp] == NO) return EIO;
+
+    for(i=0; i<nphases; i++) {
+	requests[i] = [self allocTransferRequest];
+	if([self prepareIO:requests[i] device:device endpoint:phases[i].endpoint
+		 direction:phases[i].direction data:phases[i].data ndata:phases[i].ndata] != 0) {
+	    IOLog("usb - transaction phase %d:  Can't determine endpoint\n",i);
+
+	    /* This phase got no further than its endpoint, the rest never ran */
+	    [self recycleTransferRequest:requests[i]];
+	    while(--i >= 0) {
+		[self unstageBounceBuffer:requests[i]];
+		[self recycleTransferRequest:requests[i]];
+	    }
+	    return EINVAL;
+	}
+
+	[requests[i] chainHead:requests[0]];
+	[requests[i] hardTimeOut:hardTimeOut];
+	if(i > 0) {
+	    [requests[i-1] nextPhase:requests[i]];
+	    [requests[i] completionCode:HC_CC_NOT_ACCESSED];
+	}
+    }
+
+    ioerr = [self submitRequest:requests[0] timeOut:hardTimeOut];
+    if(ioerr != 0) return ioerr;
+
+    /*
+     *  One wait for the lot.  The head only goes to TRANSFER_DONE
+     *  once the last phase which is going to run has finished, so
+     *  none of them is still on the hardware after this.
+     */
+    [self waitForRequest:requests[0]];
+
+    result = 0;
+    for(i=0; i<nphases; i++) {
+	phases[i].actual = [requests[i] actualLength];
+	phases[i].status = [requests[i] completionCode];
+	if(phases[i].status != HC_CC_NO_ERROR) result = EIO;
+
+	[self captureRequest:requests[i] address:usbAddress
+		    endpoint:phases[i].endpoint start:startTime];
+    }
+
+    for(i=nphases-1; i>=0; i--)
+	[self finishRequest:requests[i]];
+
+    return result;
+}
+
+
+/*
+ *  Fill in a TransferRequest for doIO, or for one phase of a
+ *  transaction.  Returns -1 if the device has no such endpoint.
+ */
+- (int)prepareIO:(TransferRequest *)transRequest
+	  device:(USBDevice *)device
+	endpoint:(int)endpointNum
+       direction:(int)dataDir
+	    data:(unsigned char *)reqData
+	   ndata:(int)numdata
+{
+    USBEndpoint *ep;
+
+    if(dataDir == 0) dataDir = DIR_OUT;
+    else dataDir = DIR_IN;
+    
+    [transRequest completionCode:HC_CC_NO_ERROR];
+    [transRequest device:device];
+
+    ep = [device endpointForNumber:endpointNum direction:dataDir];
+    if(ep == nil) return -1;
+    [transRequest endpoint:ep];
+    
+    /*
+     *  Make sure we haven't exceeded the maximum Endpoint
+     *  Queue length.  We can spin here till the cows come
+     *  home, and other threads still have access to the driver
+     *  because we haven't acquired the commandLock yet.
      */
     while([ep numTDsQueued] > MAXQUEUE) {
 	/* Note:  Done Queue is managed by interrupt service
@@ -2155,111 +3140,878 @@ static instPort;
 	IOSleep(250);
     }
 
-    /*
-     *   OK.  Let's get on with business
-     */
-    [transRequest command:IO_DEVIO];
-    [transRequest deviceRequest:NULL];
-    [transRequest data:reqData];
-    [transRequest dataLength:numdata];
-    [transRequest dataDir:dataDir];
-    [[transRequest transferLock] unlockWith:TRANSFER_INPROGRESS];
+    /*
+     *   OK.  Let's get on with business
+     */
+    [transRequest command:IO_DEVIO];
+    [transRequest deviceRequest:NULL];
+    [transRequest data:reqData];
+    [transRequest dataLength:numdata];
+    [transRequest dataDir:dataDir];
+
+    /* Small or awkward buffers go through a wired bounce buffer */
+    [self stageBounceBuffer:transRequest];
+    [transRequest transferState:TRANSFER_INPROGRESS];
+
+    return 0;
+}
+
+
+/*
+ *  Hand a prepared request to the I/O thread.  Everything chained
+ *  behind it goes along too.
+ */
+- (int)submitRequest:(TransferRequest *)transRequest timeOut:(int)hardTimeOut
+{
+    msg_return_t r;
+    static void usbTimeOut(void *);
+
+    /* Queue the Transfer Request */
+    [commandLock lock];
+
+    /*  Make sure we haven't exceeded the maximum Command
+     *  Queue Length.  Perhaps commandLock should be an
+     *  NXConditionLock so we don't have to loop?
+     */
+    while([usbCommandList count] > MAXQUEUE) {
+	/* Let someone else in, check later */
+	[commandLock unlock];
+	IOSleep(250);
+	[commandLock lock];
+    }
+
+#if 1
+    [transRequest expireIn:hardTimeOut];
+    if(hardTimeOut > 0) 
+      IOScheduleFunc(usbTimeOut, transRequest, hardTimeOut);
+#else
+    [transRequest expireIn:0];
+#endif
+
+    [usbCommandList addObject:transRequest];
+    [commandLock unlock];
+
+
+    /*
+     *  Tell the IOThread we have work to do.
+     *  IOThread gets this message, and sends us back
+     *  a 'commandRequestOccurred' message
+     *
+     */
+
+    r = msg_send_from_kernel(&machMessage, MSG_OPTION_NONE, 0);
+    if(r != SEND_SUCCESS) {
+	IOLog("usb - Can't send message to I/O thread: %d\n",r);
+	return EIO;
+    }
+
+    return 0;
+}
+
+
+/*
+ *  The caller is done with a completed request.  Copy IN data
+ *  back, take it off the processed list and give it back.
+ */
+- (void)finishRequest:(TransferRequest *)transRequest
+{
+    /* Copy IN data back to the caller, free the bounce buffer */
+    [self unstageBounceBuffer:transRequest];
+
+    /* Dequeue transfer request */
+    [processedLock lock];
+    [usbProcessedList removeObject:transRequest];
+    [processedLock unlock];
+
+    [self recycleTransferRequest:transRequest];
+
+    return;
+}
+
+
+/*
+ *  Wait for a request to complete.  On an endpoint with a poll
+ *  limit the caller first spins on the HCCA done head for up to
+ *  that long, and purges the done queue itself rather than wait
+ *  for the I/O thread to be scheduled.  TDs can't be reclaimed any
+ *  sooner than the controller writes them back, so that's all
+ *  there is to look at.  If the limit runs out, sleep as usual.
+ */
+- (void)waitForRequest:(TransferRequest *)transRequest
+{
+    NXConditionLock *transferLock = [transRequest transferLock];
+    int pollLimit = [[transRequest endpoint] pollLimit];
+    int waited;
+
+    if(pollLimit > 0) {
+	for(waited=0; waited<pollLimit; waited+=POLL_STEP) {
+	    if([transferLock condition] == TRANSFER_DONE) break;
+	    if(*((unsigned int *)(hccaBufferBase + HccaDoneHead)) != 0)
+		[self purgeDoneQueue];
+	    else
+		IODelay(POLL_STEP);
+	}
+
+	[statsLock lock];
+	if([transferLock condition] == TRANSFER_DONE)
+	    stats.polls++;
+	else
+	    stats.pollFallbacks++;
+	[statsLock unlock];
+    }
+
+    /* Just wait for it, the lock isn't kept */
+    [transferLock lockWhen:TRANSFER_DONE];
+    [transferLock unlockWith:TRANSFER_DONE];
+
+    return;
+}
+
+
+/*
+ *  Start a request on the hardware.  I/O thread only, with
+ *  processedLock held so a caller polling -purgeDoneQueue never
+ *  sees a TD on the done queue before it's been added to its
+ *  request.
+ */
+- (void)startRequest:(TransferRequest *)transRequest
+{
+    /*  Unplugged while it was queued.  The endpoints are skipped
+     *  and about to be freed, see -idleDeviceOnPort:.
+     */
+    if([[transRequest device] hardwareIsUp] == NO) {
+	[transRequest completionCode:CC_REMOVED];
+	[self completeRequest:transRequest];
+	return;
+    }
+
+    switch([transRequest command]) {
+      case IO_DEVREQ:
+	[self deviceRequest:transRequest];
+
+	/*  Don't unlock transRequest here -
+	 *  that's done during interrupt servicing
+	 *  when all TD's associated with this request
+	 *  have been dequeued
+	 */
+
+	break;
+
+      case IO_DEVIO:
+	/*  Nothing to move means no TDs, and no interrupt
+	 *  would ever come to finish it.  Finish it now.
+	 */
+	if([transRequest dataLength] == 0) {
+	    [self completeRequest:transRequest];
+	    break;
+	}
+
+	[self ioRequest:transRequest];
+	/*  Again, don't unlock here -
+	 *  We issue the unlock when all TD's associated
+	 *  with this request have been properly de-queued
+	 *  during interrupt servicing
+	 */
+	break;
+	
+      default:
+	IOLog("usb - unknown device request\n");
+	break;
+    }
+
+    return;
+}
+
+
+/*
+ *  A request is finished, one way or another.  This is the only
+ *  place a request's transferLock goes to TRANSFER_DONE.  The next
+ *  phase of a transaction is started right here if this one went
+ *  well.  Otherwise, or after the last phase, the caller waiting
+ *  on the chain head is woken.  Only a successful completion
+ *  starts another phase, and those only come from -purgeDoneQueue
+ *  or -startRequest:, both with processedLock held.
+ */
+- (void)completeRequest:(TransferRequest *)transRequest
+{
+    TransferRequest *head = [transRequest chainHead];
+    TransferRequest *next = [transRequest nextPhase];
+    static void usbTimeOut(void *);
+
+    /* Ring slots just hand the result back, nobody is waiting */
+    if([transRequest ring] != nil) {
+	[[transRequest ring] slotCompleted:[transRequest ringSlot]
+				    actual:[transRequest actualLength]
+				    status:[transRequest completionCode]];
+	return;
+    }
+
+    if(head == nil) {
+	[transRequest transferState:TRANSFER_DONE];
+	return;
+    }
+
+    if(([transRequest completionCode] == HC_CC_NO_ERROR) && (next != nil)) {
+	[next completionCode:HC_CC_NO_ERROR];
+	[next expireIn:[next hardTimeOut]];
+	if([next hardTimeOut] > 0)
+	    IOScheduleFunc(usbTimeOut, next, [next hardTimeOut]);
+
+	[self startRequest:next];
+	return;
+    }
+
+    [head transferState:TRANSFER_DONE];
+
+    return;
+}
+
+
+/*
+ *  Open a shared ring on a bulk or interrupt endpoint, see USBRing.h.
+ *  Returns nil if the endpoint isn't there or the ring can't be made.
+ */
+- (id)openRingOnAddress:(int)usbAddress
+	       endpoint:(int)endpointNum
+	      direction:(int)dataDir
+		  slots:(int)nslots
+		   from:(id)sender
+{
+    USBDevice *device;
+    USBEndpoint *ep;
+    USBRing *ring;
+    TransferRequest *transRequest;
+    unsigned int ringID;
+    int islot;
+
+    device = [self deviceAtAddress:usbAddress];
+    if(device == nil) return nil;
+    if((sender != self) && (sender != [device driver])) return nil;
+    if([device hardwareIsUp] == NO) return nil;
+
+    ep = [device endpointForNumber:endpointNum direction:(dataDir == 0) ? DIR_OUT : DIR_IN];
+    if(ep == nil) return nil;
+    if(([ep type] != BULK_TYPE) && ([ep type] != INTERRUPT_TYPE)) {
+	IOLog("usb - rings are for bulk and interrupt endpoints only\n");
+	return nil;
+    }
+
+    [commandLock lock];
+    ringID = nextRingID++;
+    [commandLock unlock];
+
+    ring = [[USBRing alloc] initWithSlots:nslots direction:dataDir ringID:ringID];
+    if(ring == nil) return nil;
+
+    [ring device:device endpoint:ep owner:sender];
+
+    /*  Everything about a slot's request but its length is known now.
+     *  The requests sit on the processed list with no TDs until used.
+     */
+    [processedLock lock];
+    for(islot=0; islot<nslots; islot++) {
+	transRequest = [self allocTransferRequest];
+	[transRequest command:IO_DEVIO];
+	[transRequest device:device];
+	[transRequest endpoint:ep];
+	[transRequest dataDir:(dataDir == 0) ? DIR_OUT : DIR_IN];
+	[transRequest data:[ring slotData:islot]];
+	[transRequest ring:ring slot:islot];
+	[transRequest transferState:TRANSFER_INPROGRESS];
+
+	[ring request:transRequest forSlot:islot];
+	[usbProcessedList addObject:transRequest];
+    }
+    [processedLock unlock];
+
+    [commandLock lock];
+    [ringList addObject:ring];
+    [commandLock unlock];
+
+    return ring;
+}
+
+
+/*
+ *  Have the I/O thread queue whatever has been posted to a ring.
+ *  Any number of slots can be posted for one doorbell.
+ */
+- (int)ringDoorbell:(id)ring
+{
+    msg_return_t r;
+
+    [commandLock lock];
+    if([ringList indexOf:ring] == NX_NOT_IN_LIST) {
+	[commandLock unlock];
+	return ENXIO;
+    }
+    [doorbellList addObjectIfAbsent:ring];
+    [commandLock unlock];
+
+    r = msg_send_from_kernel(&machMessage, MSG_OPTION_NONE, 0);
+    if(r != SEND_SUCCESS) {
+	IOLog("usb - Can't send message to I/O thread: %d\n",r);
+	return EIO;
+    }
+
+    return 0;
+}
+
+
+/*
+ *  Close and free a ring.  Slots on the hardware get a second to
+ *  finish; after that they're pulled off and come back CC_REMOVED.
+ *  If the I/O thread is part way through queueing the ring's slots,
+ *  that's waited out first, so it's never left holding a freed ring.
+ */
+- (void)closeRing:(id)ring from:(id)sender
+{
+    USBRing *theRing = ring;
+    USBEndpoint *ep;
+    TransferRequest *transRequest;
+    int i,islot,nslots;
+
+    if(theRing == nil) return;
+    if((sender != self) && (sender != [theRing owner])) return;
+
+    [commandLock lock];
+    if([ringList indexOf:theRing] == NX_NOT_IN_LIST) {
+	[commandLock unlock];
+	return;
+    }
+    [ringList removeObject:theRing];
+    [doorbellList removeObject:theRing];
+    [commandLock unlock];
+
+    ep = [theRing endpoint];
+    nslots = [theRing numSlots];
+
+    /* No more slots are taken after this */
+    [theRing close];
+
+    [commandLock lock];
+    while(ringInService == theRing) {
+	[commandLock unlock];
+	IOSleep(1);
+	[commandLock lock];
+    }
+    [commandLock unlock];
+
+    for(i=0; (i<RING_CLOSE_WAIT) && ([theRing numBusy] > 0); i++)
+	IOSleep(10);
+
+    if([theRing numBusy] > 0) {
+	[self pauseEndpoint:ep];
+
+	/*  Slots the controller has already retired finish normally.
+	 *  Their TDs mustn't be freed while they're on the done queue.
+	 */
+	[self waitFrames:DONE_QUEUE_FRAMES];
+	[self purgeDoneQueue];
+
+	[processedLock lock];
+	for(islot=0; islot<nslots; islot++) {
+	    transRequest = [theRing requestForSlot:islot];
+	    if([transRequest numTDsQueued] == 0) continue;
+
+	    while([transRequest numTDsQueued] > 0) {
+		USBTransfer *td = [transRequest transferAt:0];
+		[transRequest removeTransferAt:0];
+		[ep unLinkTransfer:td];
+	    }
+
+	    [transRequest completionCode:CC_REMOVED];
+	    [self completeRequest:transRequest];
+	}
+	[processedLock unlock];
+
+	/* A device on its way out keeps its endpoints skipped */
+	if([[theRing device] hardwareIsUp])
+	    [ep descriptor]->dword0.word &= ~ED_K;
+    }
+
+    [processedLock lock];
+    for(islot=0; islot<nslots; islot++)
+	[usbProcessedList removeObject:[theRing requestForSlot:islot]];
+    [processedLock unlock];
+
+    for(islot=0; islot<nslots; islot++)
+	[self recycleTransferRequest:[theRing requestForSlot:islot]];
+
+    [theRing free];
+
+    return;
+}
+
+
+/*
+ *  Turn a ring's posted slots into TDs, in order.  I/O thread only.
+ *  A slot's data page is already wired and translated, so it goes
+ *  to -ioRequest: the way a bounce buffer would.
+ */
+- (void)serviceRing:(USBRing *)ring
+{
+    TransferRequest *transRequest;
+    unsigned int length;
+    int slot;
+
+    while((slot = [ring takeSlot:&length]) >= 0) {
+	transRequest = [ring requestForSlot:slot];
+	[transRequest completionCode:HC_CC_NO_ERROR];
+	[transRequest actualLength:0];
+	[transRequest dataLength:length];
+	[transRequest dmaData:[ring slotData:slot] physical:[ring physSlotData:slot] pool:nil];
+
+	[processedLock lock];
+	[self startRequest:transRequest];
+	[processedLock unlock];
+    }
+
+    return;
+}
+
+
+- (USBRing *)ringWithID:(unsigned int)ringID
+{
+    USBRing *ring = nil;
+    int i;
+
+    [commandLock lock];
+    for(i=0; i<[ringList count]; i++) {
+	if([(USBRing *)[ringList objectAt:i] ringID] == ringID) {
+	    ring = [ringList objectAt:i];
+	    break;
+	}
+    }
+    [commandLock unlock];
+
+    return ring;
+}
+
+
+/* A device is going away, take its rings with it.  Not the I/O thread. */
+- (void)closeRingsForDevice:(USBDevice *)device
+{
+    USBRing *ring;
+    int i;
+
+    do {
+	ring = nil;
+	[commandLock lock];
+	for(i=0; i<[ringList count]; i++) {
+	    if([(USBRing *)[ringList objectAt:i] device] == device) {
+		ring = [ringList objectAt:i];
+		break;
+	    }
+	}
+	[commandLock unlock];
+
+	if(ring != nil) [self closeRing:ring from:self];
+    } while(ring != nil);
+
+    return;
+}
+
+
+/*
+ *  Open a write stream on a bulk OUT endpoint, see USBStream.h.
+ *  A slot goes to the bus once nbytes are in it, 0 meaning a full
+ *  slot, or msecs after its first write, 0 meaning never.
+ */
+- (id)openStreamOnAddress:(int)usbAddress
+		 endpoint:(int)endpointNum
+		threshold:(int)nbytes
+		 deadline:(int)msecs
+		     from:(id)sender
+{
+    USBDevice *device;
+    USBEndpoint *ep;
+    USBRing *ring;
+    USBStream *stream;
+
+    device = [self deviceAtAddress:usbAddress];
+    if(device == nil) return nil;
+
+    ep = [device endpointForNumber:endpointNum direction:DIR_OUT];
+    if((ep == nil) || ([ep type] != BULK_TYPE)) {
+	IOLog("usb - streams are for bulk OUT endpoints only\n");
+	return nil;
+    }
+
+    ring = [self openRingOnAddress:usbAddress endpoint:endpointNum
+			 direction:0 slots:STREAM_SLOTS from:sender];
+    if(ring == nil) return nil;
+
+    stream = [[USBStream alloc] initWithRing:ring controller:self
+				   threshold:nbytes deadline:msecs];
+    if(stream == nil) {
+	[self closeRing:ring from:self];
+	return nil;
+    }
+
+    [commandLock lock];
+    [streamList addObject:stream];
+    [commandLock unlock];
+
+    return stream;
+}
+
+
+/*
+ *  Flush and free a write stream.  Returns what the flush did.
+ */
+- (int)closeStream:(id)stream from:(id)sender
+{
+    USBStream *theStream = stream;
+    int result;
+
+    if(theStream == nil) return EINVAL;
+    if((sender != self) && (sender != [theStream owner])) return EACCES;
+
+    [commandLock lock];
+    if([streamList indexOf:theStream] == NX_NOT_IN_LIST) {
+	[commandLock unlock];
+	return ENXIO;
+    }
+    [streamList removeObject:theStream];
+    [commandLock unlock];
+
+    result = [theStream flush];
+    [theStream close];
+
+    [self closeRing:[theStream ring] from:self];
+    [theStream free];
+
+    return result;
+}
+
+
+/*
+ *  The device is gone, so there's nothing to flush to.  The rings
+ *  go with -closeRingsForDevice:.
+ */
+- (void)closeStreamsForDevice:(USBDevice *)device
+{
+    USBStream *stream;
+    int i;
+
+    do {
+	stream = nil;
+	[commandLock lock];
+	for(i=0; i<[streamList count]; i++) {
+	    if([[(USBStream *)[streamList objectAt:i] ring] device] == device) {
+		stream = [streamList removeObjectAt:i];
+		break;
+	    }
+	}
+	[commandLock unlock];
+
+	if(stream != nil) {
+	    [stream close];
+	    [stream free];
+	}
+    } while(stream != nil);
+
+    return;
+}
+
+
+/*
+ *  Move a bulk endpoint to a new priority class.  It goes to
+ *  the back of the class, like a newly installed endpoint.
+ *  weight is how many requests it completes before stepping
+ *  aside for others in the same class.
+ */
+- (int)setBulkPriority:(int)priority
+		weight:(int)weight
+	     onAddress:(int)usbAddress
+	      endpoint:(int)endpointNum
+	     direction:(int)dataDir
+		  from:(id)sender
+{
+    USBDevice *device;
+    USBEndpoint *ep;
+
+    if((priority < USB_BULK_PRIORITY_HIGH) || (priority > USB_BULK_PRIORITY_LOW))
+	return EINVAL;
+
+    device = [self deviceAtAddress:usbAddress];
+    if(device == nil) return ENXIO;
+    if((sender != self) && (sender != [device driver])) return EACCES;
+
+    dataDir = (dataDir == 0) ? DIR_OUT : DIR_IN;
+    ep = [device endpointForNumber:endpointNum direction:dataDir];
+    if((ep == nil) || ([ep type] != BULK_TYPE)) return EINVAL;
+
+    [bulkLock lock];
+    [ep setBulkWeight:weight];
+    if([ep bulkPriority] != priority) {
+	[ep setBulkPriority:priority];
+	if([ep bulkParked] == NO)
+	    [self requeueBulkEndpoint:ep];
+    }
+    [bulkLock unlock];
+
+    return 0;
+}
 
-    /* Queue the Transfer Request */
-    [commandLock lock];
 
-    /*  Make sure we haven't exceeded the maximum Command
-     *  Queue Length.  Perhaps commandLock should be an
-     *  NXConditionLock so we don't have to loop?
-     */
-    while([usbCommandList count] > MAXQUEUE) {
-	/* Let someone else in, check later */
-	[commandLock unlock];
-	IOSleep(250);
-	[commandLock lock];
+- (int)bulkStats:(usbBulkStats_t *)stats
+       onAddress:(int)usbAddress
+	endpoint:(int)endpointNum
+       direction:(int)dataDir
+{
+    USBDevice *device;
+    USBEndpoint *ep;
+
+    device = [self deviceAtAddress:usbAddress];
+    if(device == nil) return ENXIO;
+
+    dataDir = (dataDir == 0) ? DIR_OUT : DIR_IN;
+    ep = [device endpointForNumber:endpointNum direction:dataDir];
+    if((ep == nil) || ([ep type] != BULK_TYPE)) return EINVAL;
+
+    [ep bulkStats:stats];
+
+    return 0;
+}
+
+
+/*
+ *  Have callers waiting on this endpoint busy-poll for completion
+ *  for up to usec microseconds before sleeping, 0 turns it off.
+ *  Worth it only for short transfers where waking up the I/O thread
+ *  and then the caller costs more than the transfer itself.
+ *  Requests already queued keep the done queue delay they had.
+ */
+- (int)setPollLimit:(int)usec
+	  onAddress:(int)usbAddress
+	   endpoint:(int)endpointNum
+	  direction:(int)dataDir
+	       from:(id)sender
+{
+    USBDevice *device;
+    USBEndpoint *ep;
+
+    if(usec < 0) return EINVAL;
+
+    device = [self deviceAtAddress:usbAddress];
+    if(device == nil) return ENXIO;
+    if((sender != self) && (sender != [device driver])) return EACCES;
+
+    dataDir = (dataDir == 0) ? DIR_OUT : DIR_IN;
+    ep = [device endpointForNumber:endpointNum direction:dataDir];
+    if(ep == nil) return EINVAL;
+
+    [ep setPollLimit:usec];
+
+    return 0;
+}
+
+
+/*
+ *  TransferRequests come from a per-controller pool.  Each one
+ *  owns a List and an NXConditionLock, and creating and freeing
+ *  those on every transfer costs more than a small transfer does.
+ *  Both calls are constant time once the pool has warmed up.
+ */
+- (TransferRequest *)allocTransferRequest
+{
+    TransferRequest *transRequest;
+
+    [poolLock lock];
+
+    transRequest = [requestPool removeLastObject];
+    if(transRequest != nil)
+	poolStats.hits++;
+    else {
+	transRequest = [[TransferRequest alloc] init];
+	[transRequest tdHash:&tdHash];
+	poolStats.misses++;
+	poolStats.created++;
     }
 
-#if 1
-    [transRequest expireIn:hardTimeOut];
-    if(hardTimeOut > 0) 
-      IOScheduleFunc(usbTimeOut, transRequest, hardTimeOut);
-#else
-    [transRequest expireIn:0];
-#endif
+    poolStats.inUse++;
+    if(poolStats.inUse > poolStats.highWater)
+	poolStats.highWater = poolStats.inUse;
 
-    [usbCommandList addObject:transRequest];
-    [commandLock unlock];
+    [poolLock unlock];
 
+    return transRequest;
+}
 
-    /*
-     *  Tell the IOThread we have work to do.
-     *  IOThread gets this message, and sends us back
-     *  a 'commandRequestOccurred' message
-     *
-     */
 
-    r = msg_send_from_kernel(&machMessage, MSG_OPTION_NONE, 0);
-    if(r != SEND_SUCCESS) {
-	IOLog("usb - Can't send message to I/O thread: %d\n",r);
-	return EIO;
+- (void)recycleTransferRequest:(TransferRequest *)transRequest
+{
+    [transRequest reset];
+
+    [poolLock lock];
+
+    poolStats.inUse--;
+    if([requestPool count] < REQUEST_POOL_MAX) {
+	[requestPool addObject:transRequest];
+	transRequest = nil;
     }
+    else
+	poolStats.created--;
 
-    /* Wait till the request is filled, or until timed out */
+    [poolLock unlock];
 
-    [[transRequest transferLock] lockWhen:TRANSFER_DONE];
+    /* Pool is full, this one goes away */
+    if(transRequest != nil) [transRequest free];
 
-    /* Dequeue transfer request */
-    [processedLock lock];
-    [usbProcessedList removeObject:transRequest];
-    [processedLock unlock];
+    return;
+}
 
-    [transRequest free];
 
-    return 0;
+- (void)requestPoolStats:(requestPoolStats_t *)stats
+{
+    [poolLock lock];
+    *stats = poolStats;
+    stats->idle = [requestPool count];
+    [poolLock unlock];
+
+    return;
+}
+
+
+
+/*
+ *  -ioRequest: assumes each packet's worth of the caller's buffer
+ *  is physically contiguous.  That's only in doubt for packets
+ *  which straddle a page boundary, so only those are checked.
+ */
+- (BOOL)bufferIsContiguous:(unsigned char *)data length:(unsigned int)len maxPacket:(unsigned int)maxPacket
+{
+    unsigned int offset,npacket;
+    unsigned int physStart,physEnd;
+    vm_address_t start,end;
+
+    for(offset=0; offset<len; offset+=maxPacket) {
+	npacket = ((len - offset) < maxPacket) ? (len - offset) : maxPacket;
+	start = (vm_address_t)(data + offset);
+	end = start + npacket - 1;
+
+	if(HC_PAGE(start) == HC_PAGE(end)) continue;
+
+	if(IOPhysicalFromVirtual(IOVmTaskSelf(), start, &physStart) != IO_R_SUCCESS)
+	    return NO;
+	if(IOPhysicalFromVirtual(IOVmTaskSelf(), end, &physEnd) != IO_R_SUCCESS)
+	    return NO;
+	if(physEnd != physStart + npacket - 1)
+	    return NO;
+    }
+
+    return YES;
+}
+
+
+/*
+ *  Pick a bounce buffer for an I/O request if it's small, or if
+ *  the caller's buffer can't be handed to the controller as is.
+ *  OUT data is copied in now.  If no buffer is free the request
+ *  just goes direct, as it always used to.
+ */
+- (void)stageBounceBuffer:(TransferRequest *)transRequest
+{
+    unsigned int len = [transRequest dataLength];
+    unsigned char *buffer = NULL;
+    unsigned int physBuffer;
+    int ipool;
+
+    if(len == 0) return;
+
+    if((len > BOUNCE_THRESHOLD) &&
+       [self bufferIsContiguous:[transRequest data] length:len
+		      maxPacket:[[transRequest endpoint] maxPacketSize]])
+	return;
+
+    /* Smallest size class that fits and has a buffer free */
+    for(ipool=0; ipool<NUM_BOUNCE_POOLS; ipool++) {
+	if((bouncePool[ipool] == nil) || ([bouncePool[ipool] bufferSize] < len)) continue;
+	buffer = [bouncePool[ipool] getBuffer:&physBuffer];
+	if(buffer != NULL) break;
+    }
+
+    if(buffer == NULL) return;
+
+    if([transRequest dataDir] == DIR_OUT)
+	bcopy([transRequest data], buffer, len);
+
+    [transRequest dmaData:buffer physical:physBuffer pool:bouncePool[ipool]];
+
+    return;
+}
+
+
+/*
+ *  Called once the controller is finished with the request.
+ *  Copy IN data back out and give the bounce buffer back.
+ */
+- (void)unstageBounceBuffer:(TransferRequest *)transRequest
+{
+    unsigned int len;
+
+    if([transRequest bouncePool] == nil) return;
+
+    if([transRequest dataDir] == DIR_IN) {
+	len = [transRequest actualLength];
+	if(len > [transRequest dataLength]) len = [transRequest dataLength];
+	bcopy([transRequest dmaData], [transRequest data], len);
+    }
 
+    [[transRequest bouncePool] putBuffer:[transRequest dmaData]];
+    [transRequest dmaData:NULL physical:0 pool:nil];
+
+    return;
 }
 
 
+
 - (int)purgeDoneQueue
 {
     unsigned int physDoneHead;
     TransferRequest *purgeReq = nil;
     USBEndpoint *purgeEndpoint = nil;
     USBTransfer *purgeTransfer = nil;
+    unsigned int ndone = 0;
     int usberr;
     static void usbTimeOut(void *);
 
+    /*  Need access to the TransferRequests in the Processed List.
+     *  Callers polling for completion purge from their own threads,
+     *  so the done head is only taken with this held.
+     */
+    [processedLock lock];
+
     /* Get first TD on Done Queue Head */
     physDoneHead = *((unsigned int *)(hccaBufferBase + HccaDoneHead));
     physDoneHead &= 0xFFFFFFF0;
 
-    /* If done head is null, get out */
-    if(physDoneHead == 0) return 0;
-
     /* Detach from Hardware Queue */
     *((unsigned int *)(hccaBufferBase + HccaDoneHead)) = 0;
 
-    /* Clear the Interrupt register                       */
-    *((unsigned int *)(HcBase+HcInterruptStatus)) = HC_WDH | HC_SF | HC_FNO;
+    /*
+     *  Clear the Interrupt register.  The controller can write a new
+     *  done head after this.  SF and FNO belong to the frame clock.
+     */
+    ohci_intr_ack(&hcRegs, HC_WDH);
 
-    /* Need access to the TransferRequests in the Processed List */    
-    [processedLock lock];
+    /* If done head is null, get out */
+    if(physDoneHead == 0) {
+	[processedLock unlock];
+	return 0;
+    }
 
     do {
-	int itr,nTRs;
-
 	/*  Find out to which TransferRequest this TD belongs */
-	nTRs = [usbProcessedList count];
-	for(itr=0; itr<nTRs; itr++) {
-	    purgeReq = [usbProcessedList objectAt:itr];
-	    purgeTransfer = [purgeReq isTDQueued:physDoneHead];
-	    if(purgeTransfer != nil) break;
-	}
-
+	purgeTransfer = td_hash_find(&tdHash, physDoneHead);
 	if(purgeTransfer == nil) {
 	  IOLog("usb - done queue has unknown TD in list: %08x\n",physDoneHead);
+	  [processedLock unlock];
 	  return -1;
 	}
+	purgeReq = purgeTransfer->request;
 
         /* Find next TD in the Done Head Queue */
 	physDoneHead = ([purgeTransfer descriptor]->dword2.field.nextTD << 4) & 0xFFFFFFF0;
@@ -2267,6 +4019,25 @@ static instPort;
 
 	/* Check error status on the TD */
 	usberr = [purgeTransfer descriptor]->dword0.field.conditionCode;
+	ndone++;
+
+	/* Count what actually made it across the bus */
+	[purgeReq actualLength:[purgeReq actualLength] + [purgeTransfer bytesTransferred]];
+
+	/*
+	 *  A short IN packet halts the ED with DATA UNDERRUN, since
+	 *  -ioRequest: turns rounding off on all but the last TD.
+	 *  That's not really an error, the device just had less to
+	 *  say than we asked for.  Drop the rest of the request's TDs
+	 *  now instead of leaving them queued for data that will
+	 *  never come.
+	 */
+	if((usberr == HC_CC_DATA_UNDERRUN) &&
+	   ([purgeReq command] == IO_DEVIO) && ([purgeReq dataDir] == DIR_IN)) {
+	    [self retireShortRequest:purgeReq];
+	    usberr = HC_CC_NO_ERROR;
+	}
+
 	if(usberr != HC_CC_NO_ERROR) {
 	    [purgeReq completionCode:usberr];
 
@@ -2310,8 +4081,12 @@ static instPort;
 	  if([purgeReq expireTime] > 0)
 	      IOUnscheduleFunc(usbTimeOut, purgeReq);
 
-	  /* Notify request is filled */
-	  [[purgeReq transferLock] unlockWith:TRANSFER_DONE];
+	  /* Give the other bulk endpoints a go */
+	  if([purgeEndpoint type] == BULK_TYPE)
+	      [self bulkEndpointServed:purgeEndpoint];
+
+	  /* Notify request is filled, or start its next phase */
+	  [self completeRequest:purgeReq];
 
 	    /*
 	     *  The request is actually removed from the Processed Queue
@@ -2324,6 +4099,10 @@ static instPort;
     
     [processedLock unlock];
 
+    [statsLock lock];
+    stats.doneTDs += ndone;
+    [statsLock unlock];
+
 
     /* Now purge the errorList */
     [errorLock lock];
@@ -2338,6 +4117,40 @@ static instPort;
 
 
 
+/*
+ *  Called from -purgeDoneQueue when an IN request comes back short.
+ *  The controller has halted the ED, so it won't touch the TD chain
+ *  while we work on it.  Every TD at the head of the ED which still
+ *  belongs to this request is freed, the ED head is moved past them
+ *  with one store, and the halt is cleared.  TDs of this request which
+ *  the controller already retired are still on their way through the
+ *  done queue and are left for -purgeDoneQueue to account for.
+ */
+- (void)retireShortRequest:(TransferRequest *)transRequest
+{
+    USBEndpoint *endpoint = [transRequest endpoint];
+    USBTransfer *transfer;
+    unsigned int physTD;
+
+    physTD = ([endpoint descriptor]->dword2.field.headPointer << 4);
+
+    while((physTD != 0) && ((transfer = [transRequest isTDQueued:physTD]) != nil)) {
+	physTD = ([transfer descriptor]->dword2.field.nextTD << 4);
+	[transRequest removeTransfer:transfer];
+	[endpoint deQueueTransfer:transfer];
+    }
+
+    /* New head, halt cleared, toggle carry kept */
+    [endpoint resumeAtTD:physTD];
+
+    /* Anything queued behind us can go now */
+    ohci_command(&hcRegs, HC_CLF | HC_BLF);
+
+    return;
+}
+
+
+
 /*
  *  All Transfer requests which were marked
  *  with errors are handled here.
@@ -2359,6 +4172,7 @@ static instPort;
     TransferRequest *purgeReq;
     USBEndpoint *purgeEndpoint;
     USBTransfer *purgeTransfer;
+    BOOL claimed;
 #if 0
     standardRequest_t devRequest;
     int usberr;
@@ -2372,37 +4186,67 @@ static instPort;
 
     IOLog("usb - Processing Error packets\n");
 
+    /*  errorLock is only held to look at the list.  -purgeDoneQueue
+     *  takes it with processedLock held, and we need processedLock
+     *  to take TDs off a request.  A request is claimed by taking it
+     *  off the list with processedLock held, and only then are its
+     *  TDs removed and the request completed.  Meanwhile
+     *  -failAllRequests: may have emptied the list and completed it
+     *  itself, or the timeout thread claimed it, and then it's
+     *  skipped here.
+     */
     [errorLock lock];
     while([errorTransferList count] > 0) {
         purgeReq = [errorTransferList objectAt:0];
         purgeEndpoint = [purgeReq endpoint];
+	[errorLock unlock];
 
 	IOLog("   Pausing endpoint \n");
 
 	/* Halt this endpoint */
 	[self pauseEndpoint:purgeEndpoint];
 
-        /*  Purge this TransferRequest of all its TD's then
-	 *  unlock with TRANSFER_DONE
-	 */
-	IOLog("   Purging all TDs\n");
-        while([purgeReq numTDsQueued] > 0) {
-	    purgeTransfer = [purgeReq transferAt:0];
-	    [purgeReq removeTransferAt:0];
-	    [purgeEndpoint unLinkTransfer:purgeTransfer];
+	[processedLock lock];
+	claimed = NO;
+	[errorLock lock];
+	if(([errorTransferList indexOf:purgeReq] != NX_NOT_IN_LIST) &&
+	   ([purgeReq endpoint] == purgeEndpoint)) {
+	    [errorTransferList removeObject:purgeReq];
+	    claimed = YES;
+	}
+	[errorLock unlock];
+
+	if(claimed) {
+	    /* Its time may have run out meanwhile */
+	    [timeLock lock];
+	    [timeoutList removeObject:purgeReq];
+	    [timeLock unlock];
+
+	    /*  Purge this TransferRequest of all its TD's then
+	     *  unlock with TRANSFER_DONE
+	     */
+	    IOLog("   Purging all TDs\n");
+	    while([purgeReq numTDsQueued] > 0) {
+		purgeTransfer = [purgeReq transferAt:0];
+		[purgeReq removeTransferAt:0];
+		[purgeEndpoint unLinkTransfer:purgeTransfer];
+	    }
+	    IOLog("   All TD's removed\n");
 	}
-	IOLog("   All TD's removed\n");
+	[processedLock unlock];
 
 	/* Re-enable this endpoint */
 	IOLog("   Re-enabling endpoint \n");
 	[purgeEndpoint descriptor]->dword0.field.skip = 0;
 
-	/* Remove this Transfer Request from list */
-	[errorTransferList removeObject:purgeReq];
+	if(claimed == NO) {
+	    [errorLock lock];
+	    continue;
+	}
 
 	IOLog("   Notify with TRANSFER_DONE\n");
 	/* Notify request is terminated */
-	[[purgeReq transferLock] unlockWith:TRANSFER_DONE];
+	[self completeRequest:purgeReq];
 
 	/* 
 	 *  This routine is never coming back from the 
@@ -2440,6 +4284,7 @@ static instPort;
 	}
 #endif
 
+	[errorLock lock];
     }
     [errorLock unlock];
 
@@ -2465,6 +4310,7 @@ static instPort;
 {
     TransferRequest *timedRequest;
     USBEndpoint *timedEP;
+    BOOL claimed;
 #if 0
     int usberr;
     standardRequest_t devRequest;
@@ -2473,40 +4319,67 @@ static instPort;
     IOLog("usb - Processing Timeout packets\n");
 
     /*
-     *  Retire all Transfer Requests in the timeoutList
+     *  Retire all Transfer Requests in the timeoutList.  Like the
+     *  error list, timeLock is only held to look at it, and a
+     *  request is claimed by taking it off with processedLock held.
+     *  A usbTimeOut callout takes timeLock, so it isn't held while
+     *  the endpoint is paused.
      */
 
     [timeLock lock];
     while([timeoutList count] > 0) {
         timedRequest = [timeoutList objectAt:0];
 	timedEP = [timedRequest endpoint];
+	[timeLock unlock];
 
 	/* Halt this endpoint */
 	IOLog("   Pausing endpoint \n");
 
 	[self pauseEndpoint:timedEP];
 
-	/* Purge this TransferRequest of all its TD's and unlock with TRANSFER_DONE */
-	IOLog("   Purging all TDs\n");
-	while([timedRequest numTDsQueued] > 0) {
-	    USBTransfer *timedTD = [timedRequest transferAt:0];
-	    [timedRequest removeTransferAt:0];
-	    [timedEP unLinkTransfer:timedTD];
+	[processedLock lock];
+	claimed = NO;
+	[timeLock lock];
+	if([timeoutList indexOf:timedRequest] != NX_NOT_IN_LIST) {
+	    /* One which finished as its time ran out is just dropped */
+	    if([timedRequest numTDsQueued] == 0)
+		[timeoutList removeObject:timedRequest];
+	    else if([timedRequest endpoint] == timedEP) {
+		[timeoutList removeObject:timedRequest];
+		claimed = YES;
+	    }
 	}
+	[timeLock unlock];
 
-	IOLog("   All TD's removed\n");
+	if(claimed) {
+	    [errorLock lock];
+	    [errorTransferList removeObject:timedRequest];
+	    [errorLock unlock];
+
+	    /* Purge this TransferRequest of all its TD's and unlock with TRANSFER_DONE */
+	    IOLog("   Purging all TDs\n");
+	    while([timedRequest numTDsQueued] > 0) {
+		USBTransfer *timedTD = [timedRequest transferAt:0];
+		[timedRequest removeTransferAt:0];
+		[timedEP unLinkTransfer:timedTD];
+	    }
+	    IOLog("   All TD's removed\n");
+	}
+	[processedLock unlock];
 
 	/* Re-enable this endpoint */
 	IOLog("    Re-enabling endpoint \n");
 	[timedEP descriptor]->dword0.field.skip = 0;
 
-	/* Remove this Transfer Request from the timeout List */
-	[timeoutList removeObject:timedRequest];
+	if(claimed == NO) {
+	    [timeLock lock];
+	    continue;
+	}
 
 	IOLog("Notify with TRANSFER_DONE\n");
 	/* Notify request is terminated */
 	[timedRequest completionCode:CC_EXPIRED];
-	[[timedRequest transferLock] unlockWith:TRANSFER_DONE];
+	[self completeRequest:timedRequest];
 
 #if 0
 	/* Tell device everything is OK */
@@ -2538,6 +4411,7 @@ static instPort;
 	}
 #endif
 
+	[timeLock lock];
     }
 
     [timeLock unlock];
@@ -2556,7 +4430,6 @@ static instPort;
 
 - (void)pauseEndpoint:(USBEndpoint *)endPoint
 {
-    unsigned int control;
     unsigned int enableFlags = 0;
     unsigned int currentEDRegister =0;
 
@@ -2572,25 +4445,21 @@ static instPort;
     }
     else if([endPoint type] == CONTROL_TYPE) {
         enableFlags = HC_CLE;
-	currentEDRegister = HcBulkCurrentED;
+	currentEDRegister = HcControlCurrentED;
     }
 
 
     /* Disable processing control list */
-    control = *((unsigned int *)(HcBase+HcControl));
-    control &= ~enableFlags;
-    *((unsigned int *)(HcBase+HcControl)) = control;
+    ohci_control_clear(&hcRegs, enableFlags);
 
     /* Give it time to finish current frame */
     IOSleep(2);
 
     /* Force controller off the currentED list */
-    *((unsigned int *)(HcBase+currentEDRegister)) = 0;
+    ohci_write(&hcRegs, currentEDRegister, 0);
 
     /* Re-enable processing ED list */
-    control = *((unsigned int *)(HcBase+HcControl));
-    control |= enableFlags;
-    *((unsigned int *)(HcBase+HcControl)) = control;
+    ohci_control_set(&hcRegs, enableFlags);
 
     /*  At this point, the endpoint should be paused,
      *  and the host controller should not be accessing
@@ -2771,22 +4640,42 @@ static instPort;
     unsigned int portReset, portStatus;
 
     /* Disable interrupts while we're here */
-    *((unsigned int *)(HcBase+HcInterruptDisable)) = HC_MIE;
+    ohci_intr_master(&hcRegs, NO);
+    [statsLock lock];
+    stats.interrupts++;
+    [statsLock unlock];
+
+    /* Status bits are set whether enabled or not, only look at ours */
+    interruptStatus = ohci_read(&hcRegs, HcInterruptStatus) & ohci_intr_enabled(&hcRegs);
 
-    interruptStatus = *((unsigned int *)(HcBase+HcInterruptStatus));
+    /*
+     *  Unrecoverable Error.  The controller has stopped, and nothing
+     *  else it says can be trusted.  Recovery turns interrupts back on.
+     */
+    if((interruptStatus & HC_UE) == HC_UE) {
+	IOLog("usb - controller reports Unrecoverable Error\n");
+	[self recoverController];
+	[self enableAllInterrupts];
+	return;
+    }
 
     /* Check the Done Queue */
     if((interruptStatus & HC_WDH) == HC_WDH) {
 	[self purgeDoneQueue];
     }
 
+    /* Frame clock and callouts */
+    if(interruptStatus & (HC_SF | HC_FNO)) {
+	[self serviceFrameClock:interruptStatus];
+    }
+
     /* Check the root hub */
     if((ignoreRHSC==NO) && (interruptStatus & HC_RHSC)==HC_RHSC) {
 
 	/* Find out what needs servicing */
 	for(iport=1; iport<=numDownstreamPorts; iport++) {
 	    portReset = 0;
-	    portStatus = *((unsigned int *)(HcBase+HcRhPortStatus(iport)));
+	    portStatus = ohci_read(&hcRegs, HcRhPortStatus(iport));
 
 	    if((portStatus & HC_CSC) == HC_CSC) {
 	        BOOL connect = ((portStatus & HC_CCS) == HC_CCS);
@@ -2840,16 +4729,20 @@ static instPort;
 #endif
 	    }
 
-	    *((unsigned int *)(HcBase+HcRhPortStatus(iport))) = portReset;
+	    ohci_write(&hcRegs, HcRhPortStatus(iport), portReset);
 	}
 
     }
 
-    /* Clear status bits */
-    *((unsigned int *)(HcBase+HcInterruptStatus)) = 0x7F;
+    /*
+     *  Clear the status bits we handled, and only those.  Clearing
+     *  one which came up since we read them would lose it.  WDH was
+     *  cleared by purgeDoneQueue.
+     */
+    ohci_intr_ack(&hcRegs, interruptStatus & ~HC_WDH);
 
     /* Re-enable interrupts on the USB side */
-    *((unsigned int *)(HcBase+HcInterruptEnable)) = HC_SO | HC_WDH | HC_RD | HC_UE | HC_RHSC | HC_MIE;
+    ohci_intr_master(&hcRegs, YES);
 
     /* Re-enable interrupts on the PCI side */
     [self enableAllInterrupts];
@@ -2860,57 +4753,81 @@ static instPort;
 
 - (void)commandRequestOccurred
 {
-    int usberr;
-    TransferRequest *transRequest;
+    TransferRequest *transRequest, *phase;
+    USBRing *ring;
 
-    /*  De-Queue a request, process it,
-     *  and place on processed list
+    /*  De-Queue everything waiting, process it, and place it on the
+     *  processed list.  Requests queued while we work here come with
+     *  messages of their own, which may find nothing left to do.
      */
-    [commandLock lock];
-    transRequest = [usbCommandList objectAt:0];
-    [usbCommandList removeObjectAt:0];
-    [commandLock unlock];
+    do {
+	[commandLock lock];
+	transRequest = nil;
+	ring = nil;
+	if([usbCommandList count] > 0)
+	    transRequest = [usbCommandList removeObjectAt:0];
+	else if([doorbellList count] > 0) {
+	    ring = [doorbellList removeObjectAt:0];
+	    ringInService = ring;
+	}
+	[commandLock unlock];
 
-    [processedLock lock];
-    [usbProcessedList addObject:transRequest];
-    [processedLock unlock];
+	if(transRequest != nil) {
+	    /*  The later phases of a transaction go on the list now too.
+	     *  They have no TD's yet, so the done queue can't match them.
+	     */
+	    [processedLock lock];
+	    for(phase = transRequest; phase != nil; phase = [phase nextPhase])
+		[usbProcessedList addObject:phase];
+	    [self startRequest:transRequest];
+	    [processedLock unlock];
+	}
 
-    switch([transRequest command]) {
-      case IO_DEVREQ:
-	usberr = [self deviceRequest:transRequest];
+	if(ring != nil) {
+	    [self serviceRing:ring];
 
-	/*  Don't unlock transRequest here -
-	 *  that's done during interrupt servicing
-	 *  when all TD's associated with this request
-	 *  have been dequeued
-	 */
+	    /* -closeRing:from: may be waiting for this one */
+	    [commandLock lock];
+	    ringInService = nil;
+	    [commandLock unlock];
+	}
 
-	break;
+    } while((transRequest != nil) || (ring != nil));
 
-      case IO_DEVIO:
-	usberr = [self ioRequest:transRequest];
-	/*  Again, don't unlock here -
-	 *  We issue the unlock when all TD's associated
-	 *  with this request have been properly de-queued
-	 *  during interrupt servicing
-	 */
-	break;
-	
-      default:
-	IOLog("usb - unknown device request\n");
-	break;
+    return;
+}
+
+
+/*
+ *  Frame watchdog, every WATCHDOG_INTERVAL seconds.  A running
+ *  controller writes a new frame number to the HCCA every ms, so
+ *  one that hasn't changed means it has hung or lost the bus.
+ */
+- (void)timeoutOccurred
+{
+    unsigned int frame;
+
+    frame = *((volatile unsigned int *)(hccaBufferBase + HccaFrameNumber)) & 0xFFFF;
+
+    if(frame == watchdogFrame) {
+	IOLog("usb - frame number stuck at %d\n",frame);
+	[self recoverController];
+	return;
     }
 
+    watchdogFrame = frame;
+
     return;
 }
 
 
-- (void)timeoutOccurred
+/*  Called from the watchdog callout, hands the check to the I/O thread */
+- (void)watchdogFired
 {
-#if 1
-    IOLog("usb -  Command Request Occurred\n");
-    IOSleep(100);
-#endif
+    static void usbWatchdog(void *);
+
+    msg_send_from_kernel(&watchdogMessage, MSG_OPTION_NONE, 0);
+    IOScheduleFunc(usbWatchdog, self, WATCHDOG_INTERVAL);
 
     return;
 }
@@ -2965,7 +4882,7 @@ static instPort;
     unsigned int status;
     BOOL isDevice;
 
-    status = *((unsigned int *)(HcBase+HcRhPortStatus(portnum)));
+    status = ohci_read(&hcRegs, HcRhPortStatus(portnum));
 
     /* HC_CCS is Host Controller Current Connect Status bit */
     isDevice = (status & HC_CCS) == HC_CCS;
@@ -2981,13 +4898,13 @@ static instPort;
     unsigned char count;
     
     /* HC_SPR is Host Controller Set Port Reset  */
-    *((unsigned int *)(HcBase+HcRhPortStatus(portnum))) = HC_SPR;
+    ohci_write(&hcRegs, HcRhPortStatus(portnum), HC_SPR);
 
     /* Wait till reset complete, or timeout */
     count=0;
     for(count=0; count<50; count++) {
 	IOSleep(2);
-	status = *((unsigned int *)(HcBase+HcRhPortStatus(portnum)));
+	status = ohci_read(&hcRegs, HcRhPortStatus(portnum));
 
 	/* HC_PRS is Host Controller Port Reset Status Change */
 	if((status & HC_PRSC)==HC_PRSC) break;
@@ -3001,7 +4918,7 @@ static instPort;
 #endif
 
     /* Clear the Reset Status Change bit */
-    *((unsigned int *)(HcBase+HcRhPortStatus(portnum))) = HC_PRSC;
+    ohci_write(&hcRegs, HcRhPortStatus(portnum), HC_PRSC);
     
     return;
 }
@@ -3011,7 +4928,7 @@ static instPort;
 {
     unsigned int status;
 
-    status = *((unsigned int *)(HcBase+HcRhPortStatus(portnum)));
+    status = ohci_read(&hcRegs, HcRhPortStatus(portnum));
     status &= 0x00000200;
 
     if(status > 0) status = 1;
@@ -3023,13 +4940,13 @@ static instPort;
 
 - (unsigned int)readPortStatus:(int)portnum
 {
-    return *((unsigned int *)(HcBase+HcRhPortStatus(portnum)));
+    return ohci_read(&hcRegs, HcRhPortStatus(portnum));
 }
 
 
 - (void)writePortStatus:(int)iport value:(unsigned int)value
 {
-    *((unsigned int *)(HcBase+HcRhPortStatus(iport))) = value;
+    ohci_write(&hcRegs, HcRhPortStatus(iport), value);
 }
 
 
@@ -3046,6 +4963,648 @@ static instPort;
 
 
 
+/*
+ *  Frame clock.  HccaFrameNumber is 16 bits and the controller
+ *  raises FNO each time its top bit flips.  frameHigh counts those
+ *  flips in units of FRAME_HALF.  If bit 15 of the frame number
+ *  disagrees with frameHigh, the flip has happened and we haven't
+ *  seen the FNO yet, so fold it in here.  That makes it harmless
+ *  to fold the same flip twice, from -currentFrame and the FNO
+ *  interrupt both.
+ *
+ *  The caller holds frameLock.
+ */
+- (usbFrame_t)frameFromHardware
+{
+    unsigned int frameLow;
+
+    frameLow = *((volatile unsigned int *)(hccaBufferBase + HccaFrameNumber)) & 0xFFFF;
+    frameHigh += (frameLow ^ (unsigned int)frameHigh) & FRAME_HALF;
+
+    return frameBase + frameHigh + (frameLow & (FRAME_HALF-1));
+}
+
+
+/* Pair a frame with a time stamp for the conversions.  frameLock held. */
+- (void)anchorFrameClock
+{
+    frameAnchor = [self frameFromHardware];
+    IOGetTimestamp(&frameAnchorTime);
+    return;
+}
+
+
+/*
+ *  Called from -interruptOccurred on SF or FNO.  Each FNO
+ *  re-anchors frames to time so the conversions don't drift
+ *  more than about 33 seconds worth of crystal error.  Callouts
+ *  which are due are run one at a time after frameLock is dropped,
+ *  so they're free to schedule another.  The one running is kept
+ *  in runningCallout so -cancelFrameCallout:arg: can wait for it.
+ *  Only those due on entry are run, so one which schedules itself
+ *  for a frame already gone waits for the next interrupt.
+ */
+- (void)serviceFrameClock:(unsigned int)interruptStatus
+{
+    frameCallout_t callout;
+    usbFrame_t now;
+    int i,ndue;
+
+    [frameLock lock];
+
+    if(interruptStatus & HC_FNO) [self anchorFrameClock];
+    now = [self frameFromHardware];
+
+    for(ndue=0; (ndue < numFrameCallouts) && (frameCallouts[ndue].frame <= now); ndue++)
+	;
+
+    [frameLock unlock];
+
+    for(; ndue>0; ndue--) {
+	[frameLock lock];
+
+	/* It may have been cancelled meanwhile */
+	if((numFrameCallouts == 0) || (frameCallouts[0].frame > now)) {
+	    [frameLock unlock];
+	    break;
+	}
+
+	callout = frameCallouts[0];
+	numFrameCallouts--;
+	for(i=0; i<numFrameCallouts; i++)
+	    frameCallouts[i] = frameCallouts[i+1];
+
+	runningCallout = callout;
+	calloutRunning = YES;
+	[frameLock unlock];
+
+	callout.func(callout.arg, now);
+
+	[frameLock lock];
+	calloutRunning = NO;
+	[frameLock unlock];
+    }
+
+    /* No point taking an interrupt every frame for nothing */
+    [frameLock lock];
+    if((numFrameCallouts == 0) && (ohci_intr_enabled(&hcRegs) & HC_SF))
+	ohci_intr_disable(&hcRegs, HC_SF);
+    [frameLock unlock];
+
+    return;
+}
+
+
+- (usbFrame_t)currentFrame
+{
+    usbFrame_t frame;
+
+    [frameLock lock];
+    frame = [self frameFromHardware];
+    [frameLock unlock];
+
+    return frame;
+}
+
+
+/* IOGetTimestamp time at the start of a frame, past or future */
+- (ns_time_t)timeOfFrame:(usbFrame_t)frame
+{
+    ns_time_t nsTime;
+
+    [frameLock lock];
+    if(frame >= frameAnchor)
+	nsTime = frameAnchorTime + (frame - frameAnchor)*FRAME_NS;
+    else
+	nsTime = frameAnchorTime - (frameAnchor - frame)*FRAME_NS;
+    [frameLock unlock];
+
+    return nsTime;
+}
+
+
+/* The frame running at an IOGetTimestamp time */
+- (usbFrame_t)frameAtTime:(ns_time_t)nsTime
+{
+    usbFrame_t frame;
+
+    [frameLock lock];
+    if(nsTime >= frameAnchorTime)
+	frame = frameAnchor + (nsTime - frameAnchorTime)/FRAME_NS;
+    else
+	frame = frameAnchor - (frameAnchorTime - nsTime + FRAME_NS - 1)/FRAME_NS;
+    [frameLock unlock];
+
+    return frame;
+}
+
+
+/*
+ *  Call func(arg, frame) from the I/O thread at the first SOF
+ *  interrupt on or after frame.  A frame already gone runs at the
+ *  next SOF.  Callouts for the same frame run in the order they
+ *  were added.  Returns -1 if the table is full.
+ */
+- (int)runAtFrame:(usbFrame_t)frame func:(usbFrameFunc_t)func arg:(void *)arg
+{
+    int i,slot;
+
+    [frameLock lock];
+
+    if(numFrameCallouts >= MAX_FRAME_CALLOUTS) {
+	[frameLock unlock];
+	IOLog("usb - frame callout table full\n");
+	return -1;
+    }
+
+    for(slot=numFrameCallouts; slot>0; slot--) {
+	if(frameCallouts[slot-1].frame <= frame) break;
+    }
+
+    for(i=numFrameCallouts; i>slot; i--)
+	frameCallouts[i] = frameCallouts[i-1];
+
+    frameCallouts[slot].frame = frame;
+    frameCallouts[slot].func = func;
+    frameCallouts[slot].arg = arg;
+    numFrameCallouts++;
+
+    if((ohci_intr_enabled(&hcRegs) & HC_SF) == 0)
+	ohci_intr_enable(&hcRegs, HC_SF);
+
+    [frameLock unlock];
+
+    return 0;
+}
+
+
+/*
+ *  Take func(arg) out of the table.  If the I/O thread is running
+ *  it right now, wait for it to return, so arg can be freed after
+ *  this.  Not to be called from the callout being cancelled.
+ */
+- (void)cancelFrameCallout:(usbFrameFunc_t)func arg:(void *)arg
+{
+    int i,n;
+
+    [frameLock lock];
+
+    for(i=0,n=0; i<numFrameCallouts; i++) {
+	if((frameCallouts[i].func == func) && (frameCallouts[i].arg == arg))
+	    continue;
+	frameCallouts[n++] = frameCallouts[i];
+    }
+    numFrameCallouts = n;
+
+    /* Once this returns the callout isn't running, and won't be */
+    while(calloutRunning && (runningCallout.func == func) && (runningCallout.arg == arg)) {
+	[frameLock unlock];
+	IOSleep(1);
+	[frameLock lock];
+    }
+
+    if((numFrameCallouts == 0) && (ohci_intr_enabled(&hcRegs) & HC_SF))
+	ohci_intr_disable(&hcRegs, HC_SF);
+
+    [frameLock unlock];
+
+    return;
+}
+
+
+
+
+/*
+ *  Workload capture.  A fixed ring of compact records is wired
+ *  down when capture starts and given back when it stops.  A full
+ *  ring drops the newest record and counts it, so a reader which
+ *  falls behind sees exactly where the gap is.
+ */
+- (void)startCapture
+{
+    usbCaptureRecord_t *ring;
+
+    ring = (usbCaptureRecord_t *)IOMalloc(CAPTURE_RECORDS*sizeof(usbCaptureRecord_t));
+    if(ring == NULL) {
+	IOLog("usb - Can't allocate capture buffer\n");
+	return;
+    }
+
+    [captureLock lock];
+    if(captureRing == NULL) {
+	captureRing = ring;
+	ring = NULL;
+	captureHead = 0;
+	captureCount = 0;
+	captureDropped = 0;
+	IOGetTimestamp(&captureStart);
+    }
+    [captureLock unlock];
+
+    /* Already capturing */
+    if(ring != NULL) IOFree(ring, CAPTURE_RECORDS*sizeof(usbCaptureRecord_t));
+
+    return;
+}
+
+
+- (void)stopCapture
+{
+    usbCaptureRecord_t *ring;
+
+    [captureLock lock];
+    ring = captureRing;
+    captureRing = NULL;
+    [captureLock unlock];
+
+    if(ring != NULL) IOFree(ring, CAPTURE_RECORDS*sizeof(usbCaptureRecord_t));
+
+    return;
+}
+
+
+/*
+ *  Called by doIO and doRequest once the request is complete,
+ *  before it goes back to the pool.
+ */
+- (void)captureRequest:(TransferRequest *)transRequest
+	       address:(int)usbAddress
+	      endpoint:(int)endpointNum
+		 start:(ns_time_t)startTime
+{
+    usbCaptureRecord_t *rec;
+    standardRequest_t *devReq;
+    unsigned int maxPacket,numTDs;
+    ns_time_t now;
+
+    [statsLock lock];
+    stats.requests++;
+    stats.bytes += [transRequest actualLength];
+    [statsLock unlock];
+
+    IOGetTimestamp(&now);
+
+    if([[transRequest endpoint] type] == BULK_TYPE)
+	[[transRequest endpoint] bulkCompleted:[transRequest actualLength]
+				       latency:(unsigned int)((now - startTime)/1000)];
+
+    if(captureRing == NULL) return;
+
+    /* What -ioRequest: and -deviceRequest: queued for this */
+    maxPacket = [[transRequest endpoint] maxPacketSize];
+    if(maxPacket == 0) maxPacket = 8;
+    numTDs = ([transRequest dataLength] + maxPacket - 1)/maxPacket;
+    if([transRequest command] == IO_DEVREQ) numTDs += 2;
+
+    [captureLock lock];
+
+    if(captureRing == NULL) {
+	[captureLock unlock];
+	return;
+    }
+
+    if(captureCount >= CAPTURE_RECORDS) {
+	captureDropped++;
+	[captureLock unlock];
+	return;
+    }
+
+    rec = &captureRing[(captureHead + captureCount) % CAPTURE_RECORDS];
+    captureCount++;
+
+    rec->startTime = (startTime > captureStart) ? (unsigned int)((startTime - captureStart)/1000) : 0;
+    rec->latency = (unsigned int)((now - startTime)/1000);
+    rec->length = [transRequest dataLength];
+    rec->actual = [transRequest actualLength];
+    rec->usbAddress = usbAddress;
+    rec->endpoint = endpointNum;
+    rec->direction = [transRequest dataDir];
+    rec->result = [transRequest completionCode];
+    rec->numTDs = numTDs;
+
+    devReq = [transRequest deviceRequest];
+    if(([transRequest command] == IO_DEVREQ) && (devReq != NULL)) {
+	rec->type = USB_CAPTURE_DEVREQ;
+	rec->setup[0] = devReq->bmRequestType;
+	rec->setup[1] = devReq->bRequest;
+	rec->setup[2] = devReq->wValue.word & 0xFF;
+	rec->setup[3] = devReq->wValue.word >> 8;
+	rec->setup[4] = devReq->wIndex & 0xFF;
+	rec->setup[5] = devReq->wIndex >> 8;
+	rec->setup[6] = devReq->wLength & 0xFF;
+	rec->setup[7] = devReq->wLength >> 8;
+    }
+    else {
+	rec->type = USB_CAPTURE_DEVIO;
+	bzero(rec->setup, STANDARD_REQ_LENGTH);
+    }
+
+    [captureLock unlock];
+
+    return;
+}
+
+
+/*
+ *  Fill buffer with a header and as many whole records as fit
+ *  in nwords, oldest first.  Returns the number of words used.
+ */
+- (unsigned int)readCapture:(unsigned int *)buffer count:(unsigned int)nwords
+{
+    usbCaptureHeader_t *header = (usbCaptureHeader_t *)buffer;
+    usbCaptureRecord_t *rec;
+    unsigned int nrecs,i;
+
+    if(nwords*sizeof(unsigned int) < sizeof(usbCaptureHeader_t)) return 0;
+
+    nrecs = (nwords*sizeof(unsigned int) - sizeof(usbCaptureHeader_t))/sizeof(usbCaptureRecord_t);
+    rec = (usbCaptureRecord_t *)(header + 1);
+
+    [captureLock lock];
+
+    if(captureRing == NULL) nrecs = 0;
+    if(nrecs > captureCount) nrecs = captureCount;
+    for(i=0; i<nrecs; i++) {
+	rec[i] = captureRing[captureHead];
+	captureHead = (captureHead + 1) % CAPTURE_RECORDS;
+    }
+    captureCount -= nrecs;
+
+    header->magic = USB_CAPTURE_MAGIC;
+    header->version = USB_CAPTURE_VERSION;
+    header->recordSize = sizeof(usbCaptureRecord_t);
+    header->numRecords = nrecs;
+    header->dropped = captureDropped;
+
+    [captureLock unlock];
+
+    return (sizeof(usbCaptureHeader_t) + nrecs*sizeof(usbCaptureRecord_t))/sizeof(unsigned int);
+}
+
+
+- (void)statistics:(usbStatistics_t *)statistics
+{
+    requestPoolStats_t pool;
+
+    [self requestPoolStats:&pool];
+
+    [statsLock lock];
+    *statistics = stats;
+    [statsLock unlock];
+    statistics->transferAllocs = [USBTransfer numCreated] - statsTransferBase;
+    statistics->requestAllocs = pool.misses - statsRequestBase;
+
+    return;
+}
+
+
+- (void)resetStatistics
+{
+    requestPoolStats_t pool;
+
+    [self requestPoolStats:&pool];
+
+    [statsLock lock];
+    bzero(&stats, sizeof(stats));
+    statsTransferBase = [USBTransfer numCreated];
+    statsRequestBase = pool.misses;
+    [statsLock unlock];
+
+    return;
+}
+
+
+/*
+ *  Fill buffer with a snapshot of the schedule, see usb.h.  EDs
+ *  which don't fit are counted in header->missing.  Returns the
+ *  number of words used.
+ */
+- (unsigned int)readSnapshot:(unsigned int *)buffer count:(unsigned int)nwords
+{
+    usbSnapshotHeader_t *header = (usbSnapshotHeader_t *)buffer;
+    usbSnapshotED_t *rec;
+    USBDevice *device;
+    USBEndpoint *ep;
+    unsigned int maxrecs,nrecs,total;
+    int i,idev,iep,list;
+
+    if(nwords*sizeof(unsigned int) < sizeof(usbSnapshotHeader_t)) return 0;
+
+    maxrecs = (nwords*sizeof(unsigned int) - sizeof(usbSnapshotHeader_t))/sizeof(usbSnapshotED_t);
+    rec = (usbSnapshotED_t *)(header + 1);
+
+    header->magic = USB_SNAPSHOT_MAGIC;
+    header->version = USB_SNAPSHOT_VERSION;
+    header->recordSize = sizeof(usbSnapshotED_t);
+
+    header->hcControl = ohci_read(&hcRegs, HcControl);
+    header->hcCommandStatus = ohci_read(&hcRegs, HcCommandStatus);
+    header->hcInterruptStatus = ohci_read(&hcRegs, HcInterruptStatus);
+    header->hcInterruptEnable = ohci_read(&hcRegs, HcInterruptEnable);
+    header->hcPeriodCurrentED = ohci_read(&hcRegs, HcPeriodCurrentED);
+    header->hcControlHeadED = ohci_read(&hcRegs, HcControlHeadED);
+    header->hcControlCurrentED = ohci_read(&hcRegs, HcControlCurrentED);
+    header->hcBulkHeadED = ohci_read(&hcRegs, HcBulkHeadED);
+    header->hcBulkCurrentED = ohci_read(&hcRegs, HcBulkCurrentED);
+    header->hcDoneHead = ohci_read(&hcRegs, HcDoneHead);
+    header->hcFmInterval = ohci_read(&hcRegs, HcFmInterval);
+    header->hcFmRemaining = ohci_read(&hcRegs, HcFrameRemaining);
+    header->hcFmNumber = ohci_read(&hcRegs, HcFmNumber);
+    header->hcPeriodicStart = ohci_read(&hcRegs, HcPeriodicStart);
+
+    for(i=0; i<32; i++)
+	header->interruptTable[i] = ((unsigned int *)hccaBufferBase)[i];
+    header->hccaFrameNumber = *((unsigned int *)(hccaBufferBase + HccaFrameNumber));
+    header->hccaDoneHead = *((unsigned int *)(hccaBufferBase + HccaDoneHead));
+
+    nrecs = 0;
+    total = 0;
+
+    /* No TDs queued or retired, and no bulk EDs moved, while we look */
+    [processedLock lock];
+    [bulkLock lock];
+
+    for(ep = [[controlEDList objectAt:0] nextEndpoint]; ep != nil; ep = [ep nextEndpoint]) {
+	if(nrecs < maxrecs)
+	    [self snapshotEndpoint:ep list:USB_SNAPSHOT_CONTROL into:&rec[nrecs++]];
+	total++;
+    }
+
+    for(ep = [[bulkEDList objectAt:0] nextEndpoint]; ep != nil; ep = [ep nextEndpoint]) {
+	if(nrecs < maxrecs)
+	    [self snapshotEndpoint:ep list:USB_SNAPSHOT_BULK into:&rec[nrecs++]];
+	total++;
+    }
+
+    /* The interrupt tree shares its tail, so go by device instead */
+    [deviceLock lock];
+    for(idev=0; idev<[usbDeviceList count]; idev++) {
+	device = [usbDeviceList objectAt:idev];
+	for(iep=0; iep<=[device numEndpoints]; iep++) {
+	    ep = [device endpointAtIndex:iep];
+	    if([ep type] == INTERRUPT_TYPE) list = USB_SNAPSHOT_INTERRUPT;
+	    else if([ep type] == ISOCHRONOUS_TYPE) list = USB_SNAPSHOT_ISOCHRONOUS;
+	    else continue;
+
+	    if(nrecs < maxrecs)
+		[self snapshotEndpoint:ep list:list into:&rec[nrecs++]];
+	    total++;
+	}
+    }
+    [deviceLock unlock];
+
+    [bulkLock unlock];
+    [processedLock unlock];
+
+    header->numRecords = nrecs;
+    header->missing = total - nrecs;
+
+    return (sizeof(usbSnapshotHeader_t) + nrecs*sizeof(usbSnapshotED_t))/sizeof(unsigned int);
+}
+
+
+- (void)snapshotEndpoint:(USBEndpoint *)endpoint list:(int)list into:(usbSnapshotED_t *)rec
+{
+    ed_t *ed = [endpoint descriptor];
+    int ntds = [endpoint numTDsQueued];
+
+    rec->physED = [endpoint physicalAddress];
+    rec->dword0 = ed->dword0.word;
+    rec->tailP = ed->dword1.word;
+    rec->headP = ed->dword2.word;
+    rec->nextED = ed->dword3.word;
+    rec->bytesPending = [endpoint bytesPending];
+    rec->numTDs = (ntds > 0) ? ntds-1 : 0;
+    rec->list = list;
+
+    rec->flags = 0;
+    if(rec->dword0 & ED_K) rec->flags |= USB_SNAPSHOT_SKIP;
+    if(rec->dword0 & ED_S) rec->flags |= USB_SNAPSHOT_LOWSPEED;
+    if(rec->headP & ED_H) rec->flags |= USB_SNAPSHOT_HALTED;
+    if(rec->headP & ED_C) rec->flags |= USB_SNAPSHOT_TOGGLE;
+
+    rec->usbAddress = [endpoint usbAddress];
+    rec->endpoint = [endpoint endpointAddress];
+    rec->direction = [endpoint endpointDir];
+    rec->bulkPriority = (list == USB_SNAPSHOT_BULK) ? [endpoint bulkPriority] : 0;
+
+    return;
+}
+
+
+
+
+/*
+ *  Parameters for user space.  A daemon sits in a loop reading
+ *  USB_HOTPLUG_EVENT_PARAM and runs driverLoader for whatever
+ *  driver is named in each attach event.  We can't block the
+ *  caller here forever, so wait a while and let it try again.
+ */
+- (IOReturn)getIntValues:(unsigned int *)parameterArray
+	    forParameter:(IOParameterName)parameterName
+		   count:(unsigned int *)count
+{
+    if(strcmp(parameterName, USB_HOTPLUG_EVENT_PARAM) == 0) {
+	unsigned int nwords = sizeof(usbHotplugEvent_t)/sizeof(unsigned int);
+	usbHotplugEvent_t event;
+	int waited;
+
+	if(*count < nwords) return IO_R_INVALID_ARG;
+
+	for(waited=0; waited<HOTPLUG_WAIT; waited+=10) {
+	    if([self nextHotplugEvent:&event wait:NO] == YES) {
+		bcopy(&event, parameterArray, sizeof(usbHotplugEvent_t));
+		*count = nwords;
+		return IO_R_SUCCESS;
+	    }
+	    IOSleep(10);
+	}
+
+	*count = 0;
+	return IO_R_SUCCESS;
+    }
+
+    if(strcmp(parameterName, USB_CAPTURE_PARAM) == 0) {
+	if(captureRing == NULL) {
+	    *count = 0;
+	    return IO_R_SUCCESS;
+	}
+	*count = [self readCapture:parameterArray count:*count];
+	return (*count == 0) ? IO_R_INVALID_ARG : IO_R_SUCCESS;
+    }
+
+    if(strcmp(parameterName, USB_STATISTICS_PARAM) == 0) {
+	if(*count < sizeof(usbStatistics_t)/sizeof(unsigned int)) return IO_R_INVALID_ARG;
+
+	[self statistics:(usbStatistics_t *)parameterArray];
+	*count = sizeof(usbStatistics_t)/sizeof(unsigned int);
+	return IO_R_SUCCESS;
+    }
+
+    if(strcmp(parameterName, USB_SNAPSHOT_PARAM) == 0) {
+	*count = [self readSnapshot:parameterArray count:*count];
+	return (*count == 0) ? IO_R_INVALID_ARG : IO_R_SUCCESS;
+    }
+
+#ifdef OHCI_REG_STATS
+    if(strcmp(parameterName, USB_REGISTER_STATS_PARAM) == 0) {
+	if(*count < 2*OHCI_NUM_REGS) return IO_R_INVALID_ARG;
+
+	bcopy(hcRegs.reads, parameterArray, sizeof(hcRegs.reads));
+	bcopy(hcRegs.writes, parameterArray+OHCI_NUM_REGS, sizeof(hcRegs.writes));
+	*count = 2*OHCI_NUM_REGS;
+	return IO_R_SUCCESS;
+    }
+#endif
+
+    return [super getIntValues:parameterArray forParameter:parameterName count:count];
+}
+
+
+- (IOReturn)setIntValues:(unsigned int *)parameterArray
+	    forParameter:(IOParameterName)parameterName
+		   count:(unsigned int)count
+{
+    if(strcmp(parameterName, USB_DRIVER_MATCH_PARAM) == 0) {
+	if(count < sizeof(usbDriverMatch_t)/sizeof(unsigned int))
+	    return IO_R_INVALID_ARG;
+
+	if([self addDriverMatch:(usbDriverMatch_t *)parameterArray] != 0)
+	    return IO_R_NO_SPACE;
+
+	return IO_R_SUCCESS;
+    }
+
+    if(strcmp(parameterName, USB_CAPTURE_PARAM) == 0) {
+	if(count < 1) return IO_R_INVALID_ARG;
+
+	if(parameterArray[0]) [self startCapture];
+	else [self stopCapture];
+	return IO_R_SUCCESS;
+    }
+
+    if(strcmp(parameterName, USB_STATISTICS_PARAM) == 0) {
+	[self resetStatistics];
+	return IO_R_SUCCESS;
+    }
+
+    if(strcmp(parameterName, USB_RING_DOORBELL_PARAM) == 0) {
+	USBRing *ring;
+
+	if(count < 1) return IO_R_INVALID_ARG;
+
+	ring = [self ringWithID:parameterArray[0]];
+	if(ring == nil) return IO_R_INVALID_ARG;
+
+	if([self ringDoorbell:ring] != 0) return IO_R_IO;
+	return IO_R_SUCCESS;
+    }
+
+    return [super setIntValues:parameterArray forParameter:parameterName count:count];
+}
+
+
+
 
 
 
@@ -3106,6 +5665,9 @@ static void installdaemon(void *arg)
     do {
         [instLock lockWhen:INSTALL_NEEDED];
 
+	/* Unplugged devices go first, their addresses may be needed */
+	[driver reapDevices];
+
         if(instPort > 0) {
             IOLog("usb - waiting 2 seconds for device to come ready.");
 	    IOSleep(2000);
@@ -3120,6 +5682,8 @@ static void installdaemon(void *arg)
             instPort = 0;
         }
 
+	[driver reapDevices];
+
         [instLock unlockWith:INSTALL_IDLE];
 
     } while(1);
@@ -3153,6 +5717,20 @@ static void setIgnoreRHSC(void *arg) {
 }
 
 
+static void bulkRelink(void *arg, usbFrame_t frame)
+{
+    [(UsbOHCI *)arg relinkParkedEndpoints:frame];
+}
+
+
+static void usbWatchdog(void *arg) {
+    UsbOHCI *driver = arg;
+
+    [driver watchdogFired];
+
+}
+
+
 /*****************************  Utility Functions ********************************/
 
 unsigned int asciihex_to_uint(char *ascii_rep)
@@ -5,8 +5,43 @@
  */
 
 #import <objc/Object.h>
+#import <kernserv/ns_timer.h>
 #import "usb.h"
 
+/*
+ *  Device parameters for user space, used through IODeviceMaster
+ *
+ *  USB_HOTPLUG_EVENT_PARAM  get:  returns the next usbHotplugEvent_t,
+ *                                 waiting up to a second for one.
+ *                                 count comes back zero if none arrived.
+ *
+ *  USB_DRIVER_MATCH_PARAM   set:  adds a usbDriverMatch_t to the
+ *                                 driver match table.
+ *
+ *  USB_REGISTER_STATS_PARAM get:  64 read counts then 64 write counts,
+ *                                 one per OHCI register.  Only in a
+ *                                 driver built with OHCI_REG_STATS.
+ *
+ *  USB_CAPTURE_PARAM        set:  1 starts capturing I/O, 0 stops.
+ *                           get:  a usbCaptureHeader_t and as many
+ *                                 usbCaptureRecord_t's as fit, see usb.h.
+ *
+ *  USB_STATISTICS_PARAM     get:  usbStatistics_t.  set:  zeroes it.
+ *
+ *  USB_RING_DOORBELL_PARAM  set:  a ringID.  Queues whatever has been
+ *                                 posted to that shared ring.
+ *
+ *  USB_SNAPSHOT_PARAM       get:  a usbSnapshotHeader_t and as many
+ *                                 usbSnapshotED_t's as fit, see usb.h.
+ */
+#define USB_HOTPLUG_EVENT_PARAM  "USBHotplugEvent"
+#define USB_DRIVER_MATCH_PARAM   "USBDriverMatch"
+#define USB_REGISTER_STATS_PARAM "USBRegisterStats"
+#define USB_CAPTURE_PARAM        "USBCapture"
+#define USB_STATISTICS_PARAM     "USBStatistics"
+#define USB_RING_DOORBELL_PARAM  "USBRingDoorbell"
+#define USB_SNAPSHOT_PARAM       "USBSnapshot"
+
 @protocol OHCI_Interface
 
 - (BOOL)isUSBHost;
@@ -28,6 +63,59 @@
                                       timeOut:(int)hardTimeOut
                                          from:(id)sender;
 
+- (int)doIOonAddress:(int)usbAddress endpoint:(int)endpointNum  
+                                    direction:(int)dataDir 
+                                         data:(unsigned char *)reqData 
+                                        ndata:(int)numdata 
+                                       actual:(int *)nactual
+                                      timeOut:(int)hardTimeOut
+                                         from:(id)sender;
+
+- (int)doTransactionOnAddress:(int)usbAddress
+                       phases:(usbPhase_t *)phases
+                        count:(int)nphases
+                      timeOut:(int)hardTimeOut
+                         from:(id)sender;
+
+- (id)openRingOnAddress:(int)usbAddress
+               endpoint:(int)endpointNum
+              direction:(int)dataDir
+                  slots:(int)nslots
+                   from:(id)sender;
+- (int)ringDoorbell:(id)ring;
+- (void)closeRing:(id)ring from:(id)sender;
+
+- (id)openStreamOnAddress:(int)usbAddress
+                 endpoint:(int)endpointNum
+                threshold:(int)nbytes
+                 deadline:(int)msecs
+                     from:(id)sender;
+- (int)closeStream:(id)stream from:(id)sender;
+
+- (usbFrame_t)currentFrame;
+- (ns_time_t)timeOfFrame:(usbFrame_t)frame;
+- (usbFrame_t)frameAtTime:(ns_time_t)nsTime;
+- (int)runAtFrame:(usbFrame_t)frame func:(usbFrameFunc_t)func arg:(void *)arg;
+- (void)cancelFrameCallout:(usbFrameFunc_t)func arg:(void *)arg;
+
+- (int)setBulkPriority:(int)priority
+                weight:(int)weight
+             onAddress:(int)usbAddress
+              endpoint:(int)endpointNum
+             direction:(int)dataDir
+                  from:(id)sender;
+
+- (int)bulkStats:(usbBulkStats_t *)stats
+       onAddress:(int)usbAddress
+        endpoint:(int)endpointNum
+       direction:(int)dataDir;
+
+- (int)setPollLimit:(int)usec
+          onAddress:(int)usbAddress
+           endpoint:(int)endpointNum
+          direction:(int)dataDir
+               from:(id)sender;
+
 @end
 
 
@@ -0,0 +1 @@
+../USBBufferPool.h
\ No newline at end of file
@@ -0,0 +1 @@
+../USBBufferPool.m
\ No newline at end of file
@@ -0,0 +1 @@
+../USBRing.h
\ No newline at end of file
@@ -0,0 +1 @@
+../USBRing.m
\ No newline at end of file
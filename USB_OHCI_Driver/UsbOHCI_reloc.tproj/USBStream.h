@@ -0,0 +1 @@
+../USBStream.h
\ No newline at end of file
@@ -0,0 +1 @@
+../USBStream.m
\ No newline at end of file
@@ -56,7 +56,7 @@
 #define  HC_MIE                 0x80000000 /* Master Interrupt Enable */
 
 #define HC_ALL_INTRS (HC_SO | HC_WDH | HC_SF | HC_RD | HC_UE | HC_FNO | HC_RHSC | HC_OC)
-#define HC_NORMAL_INTRS (HC_SO | HC_WDH | HC_RD | HC_UE | HC_RHSC)
+#define HC_NORMAL_INTRS (HC_SO | HC_WDH | HC_RD | HC_UE | HC_FNO | HC_RHSC)
 
 
 
@@ -149,6 +149,8 @@ typedef unsigned int hc_physaddr_t;
 #define HC_CC_BUFFER_UNDERRUN           13
 #define HC_CC_NOT_ACCESSED              15
 #define CC_EXPIRED                      16
+#define CC_REMOVED                      17
+#define CC_HC_RESET                     18
 
 
 /********   OHCI  DATA STRUCTURES   ***********/
@@ -311,5 +313,112 @@ typedef struct {
 } iso_td_t;
 
 
-  
-	
+
+/********   DESCRIPTOR BUILDERS   ***********
+ *
+ *  The hardware reads these descriptors straight out of memory,
+ *  so filling one a bitfield at a time means a read-modify-write
+ *  of shared memory per field, with the descriptor half built in
+ *  between.  The builders below compose each dword in a register
+ *  and store it once.  The bit positions follow pg 16 (ED) and
+ *  pg 20 (TD) of the OHCI Spec.
+ */
+
+/* General TD dword0 */
+#define TD_R            0x00040000              /* Buffer Rounding  */
+#define TD_DP(d)        (((d) & 0x3) << 19)     /* Direction/PID    */
+#define TD_DI(i)        (((i) & 0x7) << 21)     /* Delay Interrupt  */
+#define TD_T(t)         (((t) & 0x3) << 24)     /* Data Toggle      */
+#define TD_EC(e)        (((e) & 0x3) << 26)     /* Error Count      */
+#define TD_CC(c)        (((c) & 0xF) << 28)     /* Condition Code   */
+
+/* ED dword0 */
+#define ED_FA(a)        ((a) & 0x7F)            /* Function Address */
+#define ED_EN(e)        (((e) & 0xF) << 7)      /* Endpoint Number  */
+#define ED_D(d)         (((d) & 0x3) << 11)     /* Direction        */
+#define ED_S            0x00002000              /* Low Speed        */
+#define ED_K            0x00004000              /* sKip             */
+#define ED_F            0x00008000              /* Isochronous Format */
+#define ED_MPS(m)       (((m) & 0x7FF) << 16)   /* Max Packet Size  */
+
+/* ED dword2 */
+#define ED_H            0x00000001              /* Halted           */
+#define ED_C            0x00000002              /* toggle Carry     */
+
+
+/*
+ *  Compile-time checks on the descriptor layouts.  A negative
+ *  array size won't compile if the compiler pads these structures.
+ */
+typedef char ohci_td_t_is_16_bytes[(sizeof(td_t) == 16) ? 1 : -1];
+typedef char ohci_ed_t_is_16_bytes[(sizeof(ed_t) == 16) ? 1 : -1];
+typedef char ohci_iso_td_t_is_32_bytes[(sizeof(iso_td_t) == 32) ? 1 : -1];
+
+
+/* dword0 of a general TD, not yet accessed by the controller */
+static __inline__ unsigned int td_flags(int dir, int delay, int toggle, int rounding)
+{
+    return TD_CC(HC_CC_NOT_ACCESSED) | TD_EC(0) | TD_T(toggle) |
+	   TD_DI(delay) | TD_DP(dir) | (rounding ? TD_R : 0);
+}
+
+
+/*
+ *  Fill a general TD.  nextTD is cleared here; the TD becomes
+ *  part of the chain only when the previous TD's nextTD is
+ *  pointed at it (-[USBEndpoint queueTransfer:]), and the
+ *  controller only looks at it once the ED's tailPointer
+ *  moves past it.
+ */
+static __inline__ void td_fill(volatile td_t *td, unsigned int flags,
+			       unsigned int currentPointer, unsigned int bufferEnd)
+{
+    td->dword1.word = currentPointer;
+    td->dword3.word = bufferEnd;
+    td->dword2.word = 0;
+    td->dword0.word = flags;
+}
+
+
+/* dword0 of an ED */
+static __inline__ unsigned int ed_flags(int funcAddress, int epAddress, int dir, int speed,
+					int skip, int format, int maxPacket)
+{
+    return ED_FA(funcAddress) | ED_EN(epAddress) | ED_D(dir) |
+	   (speed ? ED_S : 0) | (skip ? ED_K : 0) | (format ? ED_F : 0) |
+	   ED_MPS(maxPacket);
+}
+
+
+/*
+ *  The bitfield structures above and the masks here describe the
+ *  same bits.  The size checks can't catch a compiler which packs
+ *  bitfields from the other end, so check that once at start up.
+ */
+static __inline__ int ohci_layout_ok(void)
+{
+    td_t td;
+    ed_t ed;
+
+    td.dword0.word = 0;
+    td.dword0.field.bufferRounding = 1;
+    td.dword0.field.directionPID = 2;              /* IN */
+    td.dword0.field.conditionCode = HC_CC_NOT_ACCESSED;
+    if(td.dword0.word != (TD_R | TD_DP(2) | TD_CC(HC_CC_NOT_ACCESSED)))
+	return 0;
+
+    ed.dword0.word = 0;
+    ed.dword0.field.epAddress = 0xF;
+    ed.dword0.field.skip = 1;
+    ed.dword0.field.maxPacket = 0x7FF;
+    if(ed.dword0.word != (ED_EN(0xF) | ED_K | ED_MPS(0x7FF)))
+	return 0;
+
+    ed.dword2.word = 0;
+    ed.dword2.field.toggleCarry = 1;
+    if(ed.dword2.word != ED_C)
+	return 0;
+
+    return 1;
+}
+
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+/*
+ *  OHCI operational register access.
+ *
+ *  Every register read is an uncached round trip across the PCI
+ *  bus, so registers the driver owns are shadowed here and never
+ *  read back on a hot path:
+ *
+ *     HcControl           only the driver changes it, except for
+ *                         HCFS on reset and resume.  Call
+ *                         ohci_reg_resync() after either.
+ *
+ *     HcInterruptEnable   only the driver changes it.
+ *
+ *  Both shadows are changed from several threads - the I/O thread,
+ *  the daemons and client threads.  regs->lock covers each shadow
+ *  together with the register write, so a read-modify-write of one
+ *  can't lose another thread's bits.  It's taken and dropped inside
+ *  the helpers below and nothing else is taken while it's held, so
+ *  any lock may be held around a call.  Use ohci_control_update()
+ *  rather than ohci_control() followed by ohci_set_control().
+ *
+ *  HcCommandStatus, HcInterruptStatus, HcInterruptEnable/Disable
+ *  and the root hub status registers are write-1-to-set or
+ *  write-1-to-clear.  They're written with just the bits wanted;
+ *  reading one and writing it back can re-trigger bits which
+ *  happened to be set (OwnershipChangeRequest, for one).
+ *
+ *  base is normally the mapped register window, but it can be
+ *  pointed at an ordinary array of OHCI_NUM_REGS words to run the
+ *  driver's register traffic off the hardware.  Build with
+ *  OHCI_REG_STATS defined to count reads and writes per register.
+ */
+
+#ifndef _OHCIREG_H_
+#define _OHCIREG_H_
+
+#import <machkit/NXLock.h>
+#import "ohci.h"
+
+/* 256 bytes of operational registers, pg 107 OHCI Spec */
+#define OHCI_NUM_REGS   64
+#define OHCI_REG_INDEX(r)  (((r) >> 2) & (OHCI_NUM_REGS-1))
+
+typedef struct {
+    volatile unsigned int *base;        /* Mapped registers or simulated file */
+    id lock;                            /* Covers the shadows and their writes */
+    unsigned int control;               /* Shadow of HcControl                */
+    unsigned int intrEnable;            /* Shadow of HcInterruptEnable        */
+#ifdef OHCI_REG_STATS
+    unsigned int reads[OHCI_NUM_REGS];
+    unsigned int writes[OHCI_NUM_REGS];
+#endif
+} ohci_regs_t;
+
+
+static __inline__ unsigned int ohci_read(ohci_regs_t *regs, unsigned int reg)
+{
+#ifdef OHCI_REG_STATS
+    regs->reads[OHCI_REG_INDEX(reg)]++;
+#endif
+    return regs->base[reg >> 2];
+}
+
+
+static __inline__ void ohci_write(ohci_regs_t *regs, unsigned int reg, unsigned int value)
+{
+#ifdef OHCI_REG_STATS
+    regs->writes[OHCI_REG_INDEX(reg)]++;
+#endif
+    regs->base[reg >> 2] = value;
+}
+
+
+/* Re-read the shadowed registers after the controller has changed them */
+static __inline__ void ohci_reg_resync(ohci_regs_t *regs)
+{
+    [regs->lock lock];
+    regs->control = ohci_read(regs, HcControl);
+    regs->intrEnable = ohci_read(regs, HcInterruptEnable);
+    [regs->lock unlock];
+}
+
+
+static __inline__ void ohci_reg_init(ohci_regs_t *regs, volatile unsigned int *base)
+{
+#ifdef OHCI_REG_STATS
+    int i;
+
+    for(i=0; i<OHCI_NUM_REGS; i++) {
+	regs->reads[i] = 0;
+	regs->writes[i] = 0;
+    }
+#endif
+    regs->base = base;
+    regs->lock = [[NXLock alloc] init];
+    ohci_reg_resync(regs);
+}
+
+
+/* HcControl from the shadow, no bus cycle */
+static __inline__ unsigned int ohci_control(ohci_regs_t *regs)
+{
+    return regs->control;
+}
+
+
+/* Clear then set bits in HcControl as one step */
+static __inline__ void ohci_control_update(ohci_regs_t *regs, unsigned int clear, unsigned int set)
+{
+    [regs->lock lock];
+    regs->control = (regs->control & ~clear) | set;
+    ohci_write(regs, HcControl, regs->control);
+    [regs->lock unlock];
+}
+
+
+static __inline__ void ohci_set_control(ohci_regs_t *regs, unsigned int value)
+{
+    ohci_control_update(regs, ~0, value);
+}
+
+
+static __inline__ void ohci_control_set(ohci_regs_t *regs, unsigned int bits)
+{
+    ohci_control_update(regs, 0, bits);
+}
+
+
+static __inline__ void ohci_control_clear(ohci_regs_t *regs, unsigned int bits)
+{
+    ohci_control_update(regs, bits, 0);
+}
+
+
+/* HcCommandStatus is write-1-to-set, zeros are ignored (pg 117 OHCI Spec) */
+static __inline__ void ohci_command(ohci_regs_t *regs, unsigned int bits)
+{
+    ohci_write(regs, HcCommandStatus, bits);
+}
+
+
+static __inline__ void ohci_intr_enable(ohci_regs_t *regs, unsigned int bits)
+{
+    [regs->lock lock];
+    regs->intrEnable |= bits;
+    ohci_write(regs, HcInterruptEnable, bits);
+    [regs->lock unlock];
+}
+
+
+/* Writing HC_MIE here clears only MIE, the individual enables stay */
+static __inline__ void ohci_intr_disable(ohci_regs_t *regs, unsigned int bits)
+{
+    [regs->lock lock];
+    regs->intrEnable &= ~bits;
+    ohci_write(regs, HcInterruptDisable, bits);
+    [regs->lock unlock];
+}
+
+
+/*
+ *  Master interrupt enable.  Not part of the shadow, the interrupt
+ *  handler flips it on every interrupt while other threads may be
+ *  changing the individual enables.
+ */
+static __inline__ void ohci_intr_master(ohci_regs_t *regs, int on)
+{
+    ohci_write(regs, on ? HcInterruptEnable : HcInterruptDisable, HC_MIE);
+}
+
+
+static __inline__ unsigned int ohci_intr_enabled(ohci_regs_t *regs)
+{
+    return regs->intrEnable;
+}
+
+
+/* Write-1-to-clear */
+static __inline__ void ohci_intr_ack(ohci_regs_t *regs, unsigned int bits)
+{
+    ohci_write(regs, HcInterruptStatus, bits);
+}
+
+#endif /* _OHCIREG_H_ */
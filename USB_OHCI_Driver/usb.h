@@ -172,3 +172,296 @@ typedef struct {
 } endpointDescriptor_t;
 
 
+
+/*******   HOT PLUG EVENTS   ********/
+
+/*
+ *  Attach and detach events queued by the host controller
+ *  driver for a user-space daemon.  Read them one at a time
+ *  with the USB_HOTPLUG_EVENT_PARAM parameter, see UsbOHCIInterface.h
+ */
+
+#define USB_EVENT_NONE      0
+#define USB_EVENT_ATTACH    1
+#define USB_EVENT_DETACH    2
+
+#define USB_DRIVER_NAME_LENGTH  32
+
+typedef struct {
+    unsigned int   event;
+    unsigned int   sequence;        /* Bumped on every event posted   */
+    unsigned int   usbAddress;
+    unsigned int   port;            /* Root hub port                  */
+    unsigned int   class;
+    unsigned int   subClass;
+    unsigned int   vendorID;
+    unsigned int   productID;
+    unsigned int   releaseNum;
+    unsigned int   numEndpoints;    /* Not counting the control endpoint */
+    char           driverName[USB_DRIVER_NAME_LENGTH];   /* From the match table, may be empty */
+} usbHotplugEvent_t;
+
+
+/*
+ *  One entry in the driver match table.  Any field may
+ *  be USB_MATCH_ANY.  When several entries match a device,
+ *  the one with the most specific fields wins.
+ */
+
+#define USB_MATCH_ANY  (-1)
+
+typedef struct {
+    int   class;
+    int   subClass;
+    int   vendorID;
+    int   productID;
+    char  driverName[USB_DRIVER_NAME_LENGTH];
+} usbDriverMatch_t;
+
+
+/*
+ *  Bus time.  The controller's frame counter is only 16 bits,
+ *  the driver extends it to 64.  One frame is one millisecond.
+ *  Frame callouts are run from the driver's I/O thread, so they
+ *  must not wait on USB I/O themselves.
+ */
+
+typedef unsigned long long usbFrame_t;
+
+typedef void (*usbFrameFunc_t)(void *arg, usbFrame_t frame);
+
+
+/*
+ *  Workload capture.  Every doIO and doRequest call is recorded
+ *  while capture is on.  Reading the capture parameter returns a
+ *  usbCaptureHeader_t followed by header.numRecords records,
+ *  oldest first, and removes them from the driver's ring.
+ */
+
+#define USB_CAPTURE_MAGIC    0x55534243      /* 'USBC' */
+#define USB_CAPTURE_VERSION  1
+
+#define USB_CAPTURE_DEVREQ   1               /* doRequestOnAddress  */
+#define USB_CAPTURE_DEVIO    2               /* doIOonAddress       */
+
+typedef struct {
+    unsigned int   magic;
+    unsigned int   version;
+    unsigned int   recordSize;      /* sizeof(usbCaptureRecord_t)        */
+    unsigned int   numRecords;      /* Records following in this read    */
+    unsigned int   dropped;         /* Lost to a full ring since capture began */
+} usbCaptureHeader_t;
+
+typedef struct {
+    unsigned int   startTime;       /* us since capture began            */
+    unsigned int   latency;         /* us from the call to its completion */
+    unsigned int   length;          /* Bytes asked for                   */
+    unsigned int   actual;          /* Bytes moved                       */
+    unsigned char  usbAddress;
+    unsigned char  endpoint;
+    unsigned char  direction;       /* DIR_IN or DIR_OUT                 */
+    unsigned char  type;            /* USB_CAPTURE_DEVREQ or _DEVIO      */
+    unsigned short result;          /* Completion code                   */
+    unsigned short numTDs;          /* Not counting the tail TD          */
+    unsigned char  setup[STANDARD_REQ_LENGTH];   /* Device requests only */
+} usbCaptureRecord_t;
+
+
+/* Running totals, for before and after numbers */
+typedef struct {
+    unsigned int   requests;        /* doIO and doRequest calls          */
+    unsigned int   bytes;           /* Bytes moved                       */
+    unsigned int   doneTDs;         /* TDs retired off the done queue    */
+    unsigned int   interrupts;      /* Controller interrupts serviced    */
+    unsigned int   transferAllocs;  /* TDs created                       */
+    unsigned int   requestAllocs;   /* TransferRequests created          */
+    unsigned int   recoveries;      /* Controller resets after a fault   */
+    unsigned int   polls;           /* Requests a caller saw finish while polling */
+    unsigned int   pollFallbacks;   /* Polls that ran out and went to sleep */
+} usbStatistics_t;
+
+
+/*
+ *  Schedule snapshot.  Reading the snapshot parameter returns a
+ *  usbSnapshotHeader_t followed by header.numRecords records, one
+ *  for each ED in the schedule: the control list then the bulk
+ *  list, both in the order the controller walks them, then the
+ *  interrupt and isochronous EDs.  The place-holder EDs which head
+ *  each list and make up the interrupt tree aren't included.
+ *  The registers and HCCA are read first, then the EDs with the
+ *  driver's queues held still, so the EDs agree with each other
+ *  but the controller may have moved on a frame or two since the
+ *  registers were read.
+ */
+
+#define USB_SNAPSHOT_MAGIC    0x5553534e      /* 'USSN' */
+#define USB_SNAPSHOT_VERSION  1
+
+/* usbSnapshotED_t list */
+#define USB_SNAPSHOT_CONTROL      0
+#define USB_SNAPSHOT_BULK         1
+#define USB_SNAPSHOT_INTERRUPT    2
+#define USB_SNAPSHOT_ISOCHRONOUS  3
+
+/* usbSnapshotED_t flags, decoded from the ED for convenience */
+#define USB_SNAPSHOT_SKIP     0x01            /* sKip set             */
+#define USB_SNAPSHOT_HALTED   0x02            /* Halted               */
+#define USB_SNAPSHOT_TOGGLE   0x04            /* toggleCarry is DATA1 */
+#define USB_SNAPSHOT_LOWSPEED 0x08
+
+typedef struct {
+    unsigned int   magic;
+    unsigned int   version;
+    unsigned int   recordSize;      /* sizeof(usbSnapshotED_t)           */
+    unsigned int   numRecords;      /* Records following in this read    */
+    unsigned int   missing;         /* EDs which didn't fit              */
+
+    /* Operational registers */
+    unsigned int   hcControl;
+    unsigned int   hcCommandStatus;
+    unsigned int   hcInterruptStatus;
+    unsigned int   hcInterruptEnable;
+    unsigned int   hcPeriodCurrentED;
+    unsigned int   hcControlHeadED;
+    unsigned int   hcControlCurrentED;
+    unsigned int   hcBulkHeadED;
+    unsigned int   hcBulkCurrentED;
+    unsigned int   hcDoneHead;
+    unsigned int   hcFmInterval;
+    unsigned int   hcFmRemaining;
+    unsigned int   hcFmNumber;
+    unsigned int   hcPeriodicStart;
+
+    /* HCCA */
+    unsigned int   interruptTable[32];
+    unsigned int   hccaFrameNumber;
+    unsigned int   hccaDoneHead;
+} usbSnapshotHeader_t;
+
+typedef struct {
+    unsigned int   physED;
+    unsigned int   dword0;          /* The ED as the controller sees it  */
+    unsigned int   tailP;
+    unsigned int   headP;
+    unsigned int   nextED;
+    unsigned int   bytesPending;    /* Still to move on the queued TDs   */
+    unsigned short numTDs;          /* Not counting the tail TD          */
+    unsigned char  list;            /* USB_SNAPSHOT_CONTROL etc          */
+    unsigned char  flags;           /* USB_SNAPSHOT_SKIP etc             */
+    unsigned char  usbAddress;
+    unsigned char  endpoint;
+    unsigned char  direction;       /* DIR_IN, DIR_OUT, 0 from the TD    */
+    unsigned char  bulkPriority;    /* Bulk EDs only                     */
+} usbSnapshotED_t;
+
+
+/*
+ *  Busy-poll completion, see -setPollLimit:onAddress:endpoint:direction:from:.
+ *  The caller spins up to this many us for a request to finish.
+ */
+#define USB_MAX_POLL_LIMIT  2000
+
+
+/*
+ *  Bulk endpoint scheduling.  The bulk ED list is kept in priority
+ *  order, so each pass of the controller over the list reaches
+ *  higher priority endpoints first.  Within a priority, an endpoint
+ *  moves to the back of its class after weight completed requests
+ *  if another endpoint of that class has work queued.
+ */
+
+#define USB_BULK_PRIORITY_HIGH    0
+#define USB_BULK_PRIORITY_NORMAL  1
+#define USB_BULK_PRIORITY_LOW     2
+
+#define USB_BULK_DEFAULT_WEIGHT   4
+
+typedef struct {
+    int            priority;
+    int            weight;
+    unsigned int   completions;     /* Requests completed                */
+    unsigned int   bytes;           /* Bytes moved                       */
+    unsigned int   rotations;       /* Times moved to the back of its class */
+    unsigned int   totalLatency;    /* us, summed over completions       */
+    unsigned int   maxLatency;      /* us                                */
+} usbBulkStats_t;
+
+
+/*
+ *  One phase of a multi-phase transaction, see
+ *  -doTransactionOnAddress:phases:count:timeOut:from:.  The caller
+ *  fills in endpoint through ndata.  actual and status come back;
+ *  status is an HC_CC_ completion code, and HC_CC_NOT_ACCESSED for
+ *  a phase which never ran because an earlier one failed.
+ */
+
+#define USB_MAX_PHASES  8
+
+typedef struct {
+    int            endpoint;
+    int            direction;       /* 0 = OUT, otherwise IN             */
+    unsigned char  *data;
+    int            ndata;
+    int            actual;          /* Bytes moved                       */
+    int            status;          /* Completion code                   */
+} usbPhase_t;
+
+
+/*
+ *  Shared submission/completion ring, see USBRing.h.  Page 0 of a
+ *  ring holds this header, and page 1+n holds slot n's data, so a
+ *  process which maps the ring's pages in order sees
+ *
+ *      data for slot n  =  (char *)header + (n+1) * slotSize
+ *
+ *  Every slot's page is wired and its physical address worked out
+ *  when the ring is made, so posting a slot costs no copy and no
+ *  translation.
+ *
+ *  The producer fills in the slot at posted % numSlots, sets its
+ *  state to USB_SLOT_POSTED, bumps posted and rings the doorbell.
+ *  It may only do so while posted - reaped < numSlots.  The driver
+ *  moves posted slots to USB_SLOT_BUSY in order as it queues them,
+ *  and to USB_SLOT_DONE with actual and status filled in when they
+ *  finish.  The consumer hands slots back in order, setting each
+ *  to USB_SLOT_FREE and bumping reaped.  The counters run freely
+ *  and wrap.
+ *
+ *  taken, slotSize and the rest of the header are for the producer
+ *  to read.  The driver keeps its own copies, and a slot posted
+ *  while the driver still has it, or a length over slotSize, stops
+ *  or is cut short rather than believed.
+ */
+
+#define USB_RING_MAGIC      0x55524e47      /* 'URNG' */
+#define USB_RING_VERSION    1
+#define USB_RING_MAX_SLOTS  64
+#define USB_RING_SLOT_SIZE  4096            /* One page per slot */
+
+#define USB_SLOT_FREE       0
+#define USB_SLOT_POSTED     1
+#define USB_SLOT_BUSY       2
+#define USB_SLOT_DONE       3
+
+typedef struct {
+    volatile int   state;
+    unsigned int   length;          /* Producer: bytes to move, up to slotSize */
+    unsigned int   cookie;          /* Producer's own, handed back untouched   */
+    unsigned int   actual;          /* Driver: bytes moved                     */
+    int            status;          /* Driver: HC_CC_ completion code          */
+    unsigned int   reserved[3];
+} usbRingSlot_t;
+
+typedef struct {
+    unsigned int   magic;
+    unsigned int   version;
+    unsigned int   ringID;          /* For USB_RING_DOORBELL_PARAM             */
+    unsigned int   numSlots;
+    unsigned int   slotSize;
+    int            direction;       /* 0 = OUT, otherwise IN                   */
+    volatile unsigned int posted;   /* Producer                                */
+    volatile unsigned int taken;    /* Driver                                  */
+    volatile unsigned int reaped;   /* Consumer                                */
+    unsigned int   reserved[7];
+    usbRingSlot_t  slot[USB_RING_MAX_SLOTS];
+} usbRingHeader_t;
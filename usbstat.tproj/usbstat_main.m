@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2000 Howard R. Cole
+ * All rights reserved.
+ */
+
+/*
+ *  usbstat - record what the OHCI driver is asked to do, and report
+ *  on it.
+ *
+ *	usbstat [-d device] stats
+ *	usbstat [-d device] reset
+ *	usbstat [-d device] capture file [seconds]
+ *	usbstat report file
+ *
+ *  capture zeroes the driver's statistics, turns capture on, and
+ *  writes every doIO and doRequest record to file until the time is
+ *  up, followed by the statistics at the end.  report works from the
+ *  file alone, so a trace taken with one driver can be kept to set
+ *  beside one taken with the next.
+ */
+
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#import <libc.h>
+#import <driverkit/IODeviceMaster.h>
+#import "usb.h"
+#import "UsbOHCIInterface.h"
+
+#define DEFAULT_DEVICE    "UsbOHCI0"
+#define DEFAULT_SECONDS   10
+#define DRAIN_INTERVAL    100000          /* us between reads of the capture ring */
+
+/*  A trace file is this header, numRecords usbCaptureRecord_t's in
+ *  the order the driver handed them back, then a usbStatistics_t.
+ */
+#define TRACE_MAGIC    0x55535454       /* 'USTT' */
+#define TRACE_VERSION  1
+
+typedef struct {
+    unsigned int   magic;
+    unsigned int   version;
+    unsigned int   recordSize;
+    unsigned int   numRecords;
+    unsigned int   dropped;             /* Records the driver couldn't hold */
+    unsigned int   seconds;             /* How long the capture ran */
+} traceHeader_t;
+
+
+static IODeviceMaster *devMaster;
+static IOObjectNumber objectNumber;
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  usbstat [-d device] stats\n");
+    fprintf(stderr, "        usbstat [-d device] reset\n");
+    fprintf(stderr, "        usbstat [-d device] capture file [seconds]\n");
+    fprintf(stderr, "        usbstat report file\n");
+    exit(1);
+}
+
+
+static void openDevice(char *name)
+{
+    IOString kind;
+    IOReturn ret;
+
+    devMaster = [IODeviceMaster new];
+    ret = [devMaster lookUpByDeviceName:name objectNumber:&objectNumber deviceKind:&kind];
+    if(ret != IO_R_SUCCESS) {
+	fprintf(stderr, "usbstat: can't find %s (%d)\n", name, ret);
+	exit(1);
+    }
+}
+
+
+static void setParameter(char *param, unsigned int value)
+{
+    IOReturn ret;
+
+    ret = [devMaster setIntValues:&value forParameter:param
+		     objectNumber:objectNumber count:1];
+    if(ret != IO_R_SUCCESS) {
+	fprintf(stderr, "usbstat: can't set %s (%d)\n", param, ret);
+	exit(1);
+    }
+}
+
+
+static void getStatistics(usbStatistics_t *stats)
+{
+    unsigned int count = sizeof(usbStatistics_t)/sizeof(unsigned int);
+    IOReturn ret;
+
+    ret = [devMaster getIntValues:(unsigned int *)stats forParameter:USB_STATISTICS_PARAM
+		     objectNumber:objectNumber count:&count];
+    if(ret != IO_R_SUCCESS) {
+	fprintf(stderr, "usbstat: can't read statistics (%d)\n", ret);
+	exit(1);
+    }
+}
+
+
+static void printStatistics(usbStatistics_t *stats)
+{
+    printf("requests        %u\n", stats->requests);
+    printf("bytes           %u\n", stats->bytes);
+    printf("done TDs        %u\n", stats->doneTDs);
+    printf("interrupts      %u\n", stats->interrupts);
+    printf("TDs made        %u\n", stats->transferAllocs);
+    printf("requests made   %u\n", stats->requestAllocs);
+    printf("recoveries      %u\n", stats->recoveries);
+    printf("polls           %u\n", stats->polls);
+    printf("poll fallbacks  %u\n", stats->pollFallbacks);
+}
+
+
+/*  Read whatever the driver has and add it to the file.  Returns the records written. */
+static unsigned int drainCapture(FILE *fp, unsigned int *dropped)
+{
+    unsigned int buffer[IO_MAX_PARAMETER_ARRAY_LENGTH];
+    usbCaptureHeader_t *header = (usbCaptureHeader_t *)buffer;
+    unsigned int count,total = 0;
+    IOReturn ret;
+
+    for(;;) {
+	count = IO_MAX_PARAMETER_ARRAY_LENGTH;
+	ret = [devMaster getIntValues:buffer forParameter:USB_CAPTURE_PARAM
+			 objectNumber:objectNumber count:&count];
+	if((ret != IO_R_SUCCESS) || (count == 0)) break;
+	if((header->magic != USB_CAPTURE_MAGIC) ||
+	   (header->recordSize != sizeof(usbCaptureRecord_t))) {
+	    fprintf(stderr, "usbstat: driver capture format doesn't match\n");
+	    exit(1);
+	}
+
+	*dropped = header->dropped;
+	if(header->numRecords == 0) break;
+
+	fwrite(header + 1, sizeof(usbCaptureRecord_t), header->numRecords, fp);
+	total += header->numRecords;
+    }
+
+    return total;
+}
+
+
+static void capture(char *path, int seconds)
+{
+    traceHeader_t trace;
+    usbStatistics_t stats;
+    FILE *fp;
+    int waited;
+
+    fp = fopen(path, "w");
+    if(fp == NULL) {
+	perror(path);
+	exit(1);
+    }
+
+    bzero(&trace, sizeof(trace));
+    trace.magic = TRACE_MAGIC;
+    trace.version = TRACE_VERSION;
+    trace.recordSize = sizeof(usbCaptureRecord_t);
+    trace.seconds = seconds;
+    fwrite(&trace, sizeof(trace), 1, fp);
+
+    setParameter(USB_STATISTICS_PARAM, 0);
+    setParameter(USB_CAPTURE_PARAM, 1);
+
+    for(waited=0; waited<seconds*1000000; waited+=DRAIN_INTERVAL) {
+	usleep(DRAIN_INTERVAL);
+	trace.numRecords += drainCapture(fp, &trace.dropped);
+    }
+
+    /* Whatever came in before capture stopped, then the totals */
+    getStatistics(&stats);
+    trace.numRecords += drainCapture(fp, &trace.dropped);
+    setParameter(USB_CAPTURE_PARAM, 0);
+    fwrite(&stats, sizeof(stats), 1, fp);
+
+    rewind(fp);
+    fwrite(&trace, sizeof(trace), 1, fp);
+    fclose(fp);
+
+    printf("%u records, %u dropped\n", trace.numRecords, trace.dropped);
+}
+
+
+static int compareLatency(const void *a, const void *b)
+{
+    unsigned int la = ((usbCaptureRecord_t *)a)->latency;
+    unsigned int lb = ((usbCaptureRecord_t *)b)->latency;
+
+    return (la < lb) ? -1 : (la > lb);
+}
+
+
+/*  Per megabyte of data moved, or - if nothing moved */
+static void printPerMB(char *what, unsigned int n, double mbytes)
+{
+    if(mbytes > 0.0)
+	printf("%-16s%.1f\n", what, n / mbytes);
+    else
+	printf("%-16s-\n", what);
+}
+
+
+static void report(char *path)
+{
+    traceHeader_t trace;
+    usbStatistics_t stats;
+    usbCaptureRecord_t *rec;
+    unsigned int i,n,errors = 0,devreqs = 0,queuedTDs = 0;
+    unsigned int first = ~0,last = 0;
+    double bytes = 0.0,mbytes,span;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if(fp == NULL) {
+	perror(path);
+	exit(1);
+    }
+
+    if((fread(&trace, sizeof(trace), 1, fp) != 1) ||
+       (trace.magic != TRACE_MAGIC) || (trace.recordSize != sizeof(usbCaptureRecord_t))) {
+	fprintf(stderr, "usbstat: %s isn't a usbstat trace\n", path);
+	exit(1);
+    }
+
+    n = trace.numRecords;
+    rec = (usbCaptureRecord_t *)malloc((n > 0 ? n : 1) * sizeof(usbCaptureRecord_t));
+    if((rec == NULL) ||
+       (fread(rec, sizeof(usbCaptureRecord_t), n, fp) != n) ||
+       (fread(&stats, sizeof(stats), 1, fp) != 1)) {
+	fprintf(stderr, "usbstat: %s is short\n", path);
+	exit(1);
+    }
+    fclose(fp);
+
+    for(i=0; i<n; i++) {
+	bytes += rec[i].actual;
+	queuedTDs += rec[i].numTDs;
+	if(rec[i].result != 0) errors++;
+	if(rec[i].type == USB_CAPTURE_DEVREQ) devreqs++;
+	if(rec[i].startTime < first) first = rec[i].startTime;
+	if(rec[i].startTime + rec[i].latency > last) last = rec[i].startTime + rec[i].latency;
+    }
+
+    mbytes = bytes / (1024.0*1024.0);
+    span = (n > 0) ? (last - first) / 1000000.0 : 0.0;
+
+    printf("requests        %u (%u device requests, %u failed)\n", n, devreqs, errors);
+    if(trace.dropped > 0)
+	printf("dropped         %u, the figures below are missing these\n", trace.dropped);
+    printf("bytes           %.0f\n", bytes);
+    if(span > 0.0)
+	printf("throughput      %.1f KB/s over %.3f s\n", bytes / 1024.0 / span, span);
+
+    /* Completion latency, from the call to the caller being woken */
+    if(n > 0) {
+	qsort(rec, n, sizeof(usbCaptureRecord_t), compareLatency);
+	printf("latency p50     %u us\n", rec[(n-1)*50/100].latency);
+	printf("latency p99     %u us\n", rec[(n-1)*99/100].latency);
+	printf("latency max     %u us\n", rec[n-1].latency);
+    }
+
+    printPerMB("TDs/MB", queuedTDs, mbytes);
+    printPerMB("done TDs/MB", stats.doneTDs, stats.bytes / (1024.0*1024.0));
+    printPerMB("interrupts/MB", stats.interrupts, stats.bytes / (1024.0*1024.0));
+    printf("TDs made        %u\n", stats.transferAllocs);
+    printf("requests made   %u\n", stats.requestAllocs);
+    if(stats.recoveries > 0)
+	printf("recoveries      %u\n", stats.recoveries);
+
+    free(rec);
+}
+
+
+int main(int argc, char *argv[])
+{
+    char *device = DEFAULT_DEVICE;
+    usbStatistics_t stats;
+    int seconds;
+
+    if((argc > 2) && (strcmp(argv[1], "-d") == 0)) {
+	device = argv[2];
+	argc -= 2;
+	argv += 2;
+    }
+    if(argc < 2) usage();
+
+    if(strcmp(argv[1], "report") == 0) {
+	if(argc != 3) usage();
+	report(argv[2]);
+	exit(0);
+    }
+
+    openDevice(device);
+
+    if(strcmp(argv[1], "stats") == 0) {
+	getStatistics(&stats);
+	printStatistics(&stats);
+    }
+    else if(strcmp(argv[1], "reset") == 0) {
+	setParameter(USB_STATISTICS_PARAM, 0);
+    }
+    else if(strcmp(argv[1], "capture") == 0) {
+	if((argc < 3) || (argc > 4)) usage();
+	seconds = (argc == 4) ? atoi(argv[3]) : DEFAULT_SECONDS;
+	if(seconds <= 0) usage();
+	capture(argv[2], seconds);
+    }
+    else
+	usage();
+
+    exit(0);
+}